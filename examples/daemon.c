@@ -0,0 +1,227 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "opendps/opendps.h"
+#include "opendps/events.h"
+#include "daemon.h"
+
+#define MAX_CLIENTS 64
+#define MAX_FRAME_SIZE 4096
+// a client gives up after 10 timeouts, within the 1s the daemon waits for the DPS
+#define CLIENT_TIMEOUT_MS 100
+#define EVENT_POLL_MS 250
+
+typedef struct client_t {
+	int fd;
+	int len;				// length of pending request, 0 if none
+	__uint8_t frame[MAX_FRAME_SIZE];
+} client_t;
+
+static client_t clients[MAX_CLIENTS];
+static volatile sig_atomic_t running = 1;
+
+static void stop_daemon(int sig)
+{
+	running = 0;
+}
+
+void daemon_socket_path(const char *serial_device, char *path, size_t size)
+{
+	const char *name = strrchr(serial_device, '/');
+	snprintf(path, size, "/tmp/dpsctl-%s.sock", name != NULL ? name + 1 : serial_device);
+}
+
+int daemon_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = CLIENT_TIMEOUT_MS * 1000 };
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		return -errno;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		int rc = -errno;
+		close(fd);
+		return rc;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return fd;
+}
+
+/*
+ * Commands without side effects. Identical requests for these that arrive
+ * in the same poll round are sent to the DPS once.
+ */
+static bool coalescable(__uint8_t cmd)
+{
+	return cmd == CMD_PING || cmd == CMD_QUERY || cmd == CMD_VERSION || cmd == CMD_LIST_FUNCTIONS ||
+		cmd == CMD_LIST_PARAMETERS || cmd == CMD_TEMPERATURE_REPORT || cmd == CMD_CAL_REPORT;
+}
+
+/*
+ * Forward one frame to the DPS and encode the response frame for the
+ * client. A failed transaction is answered with an empty message and left
+ * to the retry logic of the client.
+ */
+static int forward(const __uint8_t *frame, int len, __uint8_t *reply, int reply_size)
+{
+	__uint8_t response_buffer[256];
+	int rc = dps_send_frame(frame, len);
+	if (rc < 0)
+		return 0;
+	rc = dps_get_response(&response_buffer, sizeof(response_buffer));
+	if (rc <= 0)
+		return 0;
+	rc = dps_encode_frame(response_buffer, rc, reply, reply_size);
+	return rc < 0 ? 0 : rc;
+}
+
+/*
+ * Unsolicited frames, taken out of the response stream by the library or
+ * picked up while idle, are passed on to every client. Clients that do
+ * not keep up lose events rather than stall the daemon.
+ */
+static void forward_event(void *ctx, const dps_event_t *event)
+{
+	__uint8_t cmd[1 + DPS_EVENT_PAYLOAD_SIZE];
+	__uint8_t frame[DPS_FRAME_SIZE(sizeof(cmd))];
+	cmd[0] = event->cmd;
+	memcpy(cmd + 1, event->payload, event->len);
+	int len = dps_encode_frame(cmd, 1 + event->len, frame, sizeof(frame));
+	if (len < 0)
+		return;
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			send(clients[i].fd, frame, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void serve_round(void)
+{
+	__uint8_t reply[MAX_FRAME_SIZE];
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		client_t *client = &clients[i];
+		if (client->len == 0)
+			continue;
+		int reply_len = forward(client->frame, client->len, reply, sizeof(reply));
+		send(client->fd, reply, reply_len, MSG_NOSIGNAL);
+
+		// answer identical requests from other clients with the same reply
+		if (client->len > 1 && coalescable(client->frame[1])) {
+			for (int j = i + 1; j < MAX_CLIENTS; j++) {
+				client_t *other = &clients[j];
+				if (other->len == client->len && memcmp(other->frame, client->frame, client->len) == 0) {
+					send(other->fd, reply, reply_len, MSG_NOSIGNAL);
+					other->len = 0;
+				}
+			}
+		}
+		client->len = 0;
+	}
+}
+
+int daemon_run(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct pollfd fds[MAX_CLIENTS + 1];
+	int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (listen_fd < 0)
+		return -errno;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, 16) != 0) {
+		int rc = -errno;
+		fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+		close(listen_fd);
+		return rc;
+	}
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+	signal(SIGINT, stop_daemon);
+	signal(SIGTERM, stop_daemon);
+	dps_subscribe(DPS_EVENT_ANY, forward_event, NULL);
+	printf("Serving on %s\n", path);
+
+	while (running) {
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN;
+		}
+		int ready = poll(fds, MAX_CLIENTS + 1, EVENT_POLL_MS);
+		if (ready < 0)
+			continue;
+		if (ready == 0) {
+			// no requests, look for events on the DPS link
+			dps_poll_events();
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listen_fd, NULL, NULL);
+			for (int i = 0; fd >= 0 && i < MAX_CLIENTS; i++) {
+				if (clients[i].fd < 0) {
+					clients[i].fd = fd;
+					clients[i].len = 0;
+					fd = -1;
+				}
+			}
+			if (fd >= 0)
+				close(fd); // no free slot
+		}
+
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			if (clients[i].fd < 0 || !(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			int len = recv(clients[i].fd, clients[i].frame, sizeof(clients[i].frame), 0);
+			if (len <= 0) {
+				close(clients[i].fd);
+				clients[i].fd = -1;
+				clients[i].len = 0;
+			} else {
+				clients[i].len = len;
+			}
+		}
+
+		serve_round();
+	}
+
+	dps_unsubscribe(forward_event, NULL);
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+	close(listen_fd);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * dpsctl daemon mode.
+ * The daemon keeps the serial port open and serves local clients over a
+ * Unix domain socket. Clients send the same frames they would send to the
+ * DPS, one frame per SOCK_SEQPACKET message, and get the response frame
+ * back, so any libopendps call works unchanged through dps_init_fd().
+ */
+
+#ifndef __DPSCTL_DAEMON_H__
+#define __DPSCTL_DAEMON_H__
+
+#include <stddef.h>
+
+void daemon_socket_path(const char *serial_device, char *path, size_t size);
+int daemon_connect(const char *path);
+int daemon_run(const char *path);
+
+#endif //__DPSCTL_DAEMON_H__
@@ -24,13 +24,28 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include "opendps/opendps.h"
+#include "opendps/sequence.h"
+#include "opendps/sweep.h"
+#include "opendps/store.h"
+#include "opendps/stats.h"
+#include "opendps/link.h"
+#include "opendps/publish.h"
+#include "opendps/transact.h"
+#include "opendps/transport.h"
+#include "opendps/events.h"
+#include "daemon.h"
+#include "fleet.h"
+
+#define MAX_RAW_COMMANDS 16
 
 // argument
 
@@ -42,7 +57,375 @@ static void print_upgrade_progress(__uint8_t progress)
 
 void print_usage(char *program)
 {
-	fprintf(stderr, "Usage: %s [-v] [-i] [-d device] [-b baudrate] [-B brightness] [-c current] [-V voltage] <-l | -L | -o | -O -p>\n", program);
+	fprintf(stderr, "Usage: %s [-v] [-i] [-D] [-w] [-d device] [-b baudrate] [-B brightness] [-c current] [-V voltage] [-S sequence] [-W param,start,stop,step,settle_ms,samples] [-R store [-T interval_ms]] [-E store[,from_ms,to_ms]] [-P shm [-T interval_ms]] [-M shm] [-X cmd[,payload]]* [-F manifest [-j workers]] <-l | -L | -o | -O -p>\n", program);
+}
+
+/*
+ * Sequence file format, one step per line:
+ *   <offset in ms> <parameter>=<value> [<parameter>=<value>]*
+ * Lines starting with '#' are ignored.
+ */
+static int load_sequence(const char *file_name, dps_seq_step_t **steps)
+{
+	FILE *file = fopen(file_name, "r");
+	char line[256];
+	int count = 0;
+	*steps = NULL;
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open sequence file: %s\n", file_name);
+		return -EIO;
+	}
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char *tok = strtok(line, " \t\r\n");
+		if (tok == NULL || tok[0] == '#')
+			continue;
+		dps_seq_step_t *tmp = realloc(*steps, (count + 1) * sizeof(dps_seq_step_t));
+		if (tmp == NULL)
+			break;
+		*steps = tmp;
+		dps_seq_step_t *step = &tmp[count++];
+		memset(step, 0, sizeof(*step));
+		step->offset_us = atol(tok) * 1000;
+		while ((tok = strtok(NULL, " \t\r\n")) != NULL && step->num_params < DPS_SEQ_MAX_PARAMS) {
+			char *value = strchr(tok, '=');
+			if (value == NULL)
+				continue;
+			*value++ = '\0';
+			step->params[step->num_params].name = strdup(tok);
+			step->params[step->num_params].value = atoi(value);
+			step->num_params++;
+		}
+	}
+	fclose(file);
+	return count;
+}
+
+static void free_sequence(dps_seq_step_t *steps, int count)
+{
+	for (int i = 0; i < count; i++)
+		for (int j = 0; j < steps[i].num_params; j++)
+			free((char *)steps[i].params[j].name);
+	free(steps);
+}
+
+// udp:<host>[:<port>]
+static int init_udp(const char *spec, bool verbose)
+{
+	char host[256];
+	int port = DPS_UDP_PORT;
+	const char *sep = strrchr(spec, ':');
+	size_t len = sep != NULL ? (size_t)(sep - spec) : strlen(spec);
+	if (len >= sizeof(host))
+		return -EINVAL;
+	memcpy(host, spec, len);
+	host[len] = '\0';
+	if (sep != NULL)
+		port = atoi(sep + 1);
+	return dps_init_udp(host, port, verbose);
+}
+
+static __uint8_t *load_image(const char *file_name, long *size)
+{
+	FILE *file = fopen(file_name, "r");
+	__uint8_t *image = NULL;
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open firmware file: %s\n", file_name);
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	*size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if (*size > 0 && (image = malloc(*size)) != NULL && fread(image, 1, *size, file) != (size_t) *size) {
+		free(image);
+		image = NULL;
+	}
+	fclose(file);
+	return image;
+}
+
+static int run_fleet(const char *manifest, int workers, fleet_op_t *op, const char *firmware_file)
+{
+	__uint8_t *image = NULL;
+	if (firmware_file != NULL) {
+		// parsed once, shared by all workers
+		image = load_image(firmware_file, &op->image_size);
+		if (image == NULL)
+			return -EIO;
+		op->image = image;
+	}
+	int rc = fleet_run(manifest, op, workers > 0 ? workers : 1);
+	free(image);
+	return rc;
+}
+
+static volatile sig_atomic_t running = 1;
+
+static void stop_running(int sig)
+{
+	running = 0;
+}
+
+static int record_store(const char *file_name, int interval_ms)
+{
+	dps_store_t store;
+	dps_query_t status;
+	dps_stats_t stats;
+	dps_stats_result_t result;
+	struct timespec start, start_mono, mono;
+	__int64_t timestamp_ms;
+	long samples = 0;
+	int rc = dps_store_open(&store, file_name, true);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to open store %s: %s\n", file_name, strerror(-rc));
+		return rc;
+	}
+	// survive a replugged adapter, not supported on daemon and UDP links
+	dps_link_supervision_t supervision = { .policy = DPS_LINK_REPLAY, .replay_timeout_ms = interval_ms };
+	dps_supervise(&supervision);
+	dps_stats_init(&stats, DPS_STATS_WINDOW);
+	signal(SIGINT, stop_running);
+	signal(SIGTERM, stop_running);
+	// wall time anchored once, so a clock step does not break the store's ordering
+	clock_gettime(CLOCK_REALTIME, &start);
+	clock_gettime(CLOCK_MONOTONIC, &start_mono);
+	while (running) {
+		if (dps_query(&status) == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &mono);
+			dps_stats_add(&stats, (__int64_t) mono.tv_sec * 1000000 + mono.tv_nsec / 1000, &status);
+			timestamp_ms = (__int64_t) start.tv_sec * 1000 + start.tv_nsec / 1000000
+				+ (__int64_t) (mono.tv_sec - start_mono.tv_sec) * 1000 + (mono.tv_nsec - start_mono.tv_nsec) / 1000000;
+			// the store may end in the future of this clock when appending to it
+			if (timestamp_ms < store.last[0])
+				timestamp_ms = store.last[0];
+			rc = dps_store_append(&store, timestamp_ms, &status);
+			if (rc < 0) {
+				fprintf(stderr, "Failed to append sample: %s\n", strerror(-rc));
+				break;
+			}
+			samples++;
+		}
+		usleep(interval_ms * 1000);
+	}
+	dps_store_close(&store);
+	printf("Recorded %ld samples to %s\n", samples, file_name);
+	dps_stats_total(&stats, &result);
+	if (result.count > 0) {
+		printf("Duration : %.1f s\n", result.duration_s);
+		printf("V_out    : min %.2f V, max %.2f V, mean %.3f V, rms %.3f V\n", result.v_min / 1000.0, result.v_max / 1000.0, result.v_mean / 1000, result.v_rms / 1000);
+		printf("I_out    : min %.3f A, max %.3f A, mean %.4f A, rms %.4f A\n", result.i_min / 1000.0, result.i_max / 1000.0, result.i_mean / 1000, result.i_rms / 1000);
+		printf("Charge   : %.3f mAh\n", result.charge_mah);
+		printf("Energy   : %.4f Wh\n", result.energy_wh);
+	}
+	return rc;
+}
+
+/*
+ * Raw command, given as <command>[,<payload in hex>], ie. 0x10,00fa00fa
+ * reports 25.0 and 25.0 degrees to the DPS.
+ */
+static int raw_transact(const char *spec)
+{
+	__uint8_t payload[INPUT_BUFFER_SIZE];
+	dps_response_t response;
+	char *end;
+	int len = 0;
+	long cmd = strtol(spec, &end, 0);
+	if (end == spec || cmd < 0 || cmd >= CMD_RESPONSE || (*end != '\0' && *end != ',')) {
+		fprintf(stderr, "Invalid command: %s\n", spec);
+		return -EINVAL;
+	}
+	for (const char *hex = *end == ',' ? end + 1 : end; *hex != '\0'; hex += 2) {
+		unsigned int byte;
+		if (len == sizeof(payload) || sscanf(hex, "%2x", &byte) != 1 || hex[1] == '\0') {
+			fprintf(stderr, "Invalid payload: %s\n", spec);
+			return -EINVAL;
+		}
+		payload[len++] = byte;
+	}
+	int rc = dps_transact(cmd, payload, len, &response, NULL);
+	if (rc < 0 && rc != -EREMOTEIO) {
+		printf("Command %#.2lx... Failed (%s)\n", cmd, strerror(-rc));
+		return rc;
+	}
+	printf("Command %#.2lx... Status %#.2x [", cmd, response.status);
+	for (int i = 0; i < response.len; i++)
+		printf(" %2.2x", response.data[i]);
+	printf(" ]\n");
+	return rc;
+}
+
+static int publish_state(const char *segment, const char *device, int interval_ms)
+{
+	dps_publisher_t publisher;
+	dps_query_t status;
+	dps_link_supervision_t supervision = { .policy = DPS_LINK_FAIL_FAST };
+	int rc = dps_publisher_open(&publisher, segment, device);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to publish to %s: %s\n", segment, strerror(-rc));
+		return rc;
+	}
+	dps_supervise(&supervision);
+	signal(SIGINT, stop_running);
+	signal(SIGTERM, stop_running);
+	while (running) {
+		rc = dps_query(&status);
+		dps_publish(&publisher, rc, &status);
+		usleep(interval_ms * 1000);
+	}
+	dps_publisher_close(&publisher);
+	return 0;
+}
+
+static int print_published(const char *segment)
+{
+	dps_reader_t reader;
+	dps_shm_state_t state;
+	struct timespec now;
+	int rc = dps_reader_open(&reader, segment);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", segment, strerror(-rc));
+		return rc;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	printf("%-24s %8s %8s %8s %6s %5s %8s %8s\n", "Device", "V_in", "V_out", "I_out", "Output", "Link", "Age ms", "Updates");
+	for (int i = 0; i < DPS_SHM_SLOTS; i++) {
+		if (dps_reader_snapshot(&reader, i, &state) != 0)
+			continue;
+		printf("%-24s %8.2f %8.2f %8.3f %6s %5s %8lld %8llu\n", state.device,
+		       state.status.v_in / 1000.0, state.status.v_out / 1000.0, state.status.i_out / 1000.0,
+		       state.status.output_enabled ? "ON" : "OFF",
+		       state.query_rc == 0 && state.health.state == DPS_LINK_UP ? "UP" : "DOWN",
+		       (long long)((__int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000 - state.published_ms),
+		       (unsigned long long) state.updates);
+	}
+	dps_reader_close(&reader);
+	return 0;
+}
+
+static void print_event(void *ctx, const dps_event_t *event)
+{
+	printf("[%ld.%03ld] ", (long) event->timestamp.tv_sec, event->timestamp.tv_nsec / 1000000);
+	if (event->cmd == CMD_OCP_EVENT) {
+		printf("Over current protection, output cut at %d mA\n", dps_ocp_current(event));
+	} else {
+		printf("Event %2.2x [", event->cmd);
+		for (int i = 0; i < event->len; i++)
+			printf(" %2.2x", event->payload[i]);
+		printf(" ]\n");
+	}
+	fflush(stdout);
+}
+
+static int watch_events(void)
+{
+	int rc = dps_subscribe(DPS_EVENT_ANY, print_event, NULL);
+	if (rc < 0)
+		return rc;
+	signal(SIGINT, stop_running);
+	signal(SIGTERM, stop_running);
+	while (running && (rc = dps_poll_events()) >= 0);
+	dps_unsubscribe(print_event, NULL);
+	return rc < 0 ? rc : 0;
+}
+
+static int print_csv_sample(void *ctx, __int64_t timestamp_ms, const dps_query_t *sample)
+{
+	printf("%lld,%u,%u,%u,%d,%d", (long long) timestamp_ms, sample->v_in, sample->v_out, sample->i_out,
+		sample->output_enabled, sample->temp_shutdown);
+	if (sample->temp1 != -DBL_MAX)
+		printf(",%.1f", sample->temp1);
+	else
+		printf(",");
+	if (sample->temp2 != -DBL_MAX)
+		printf(",%.1f\n", sample->temp2);
+	else
+		printf(",\n");
+	return 0;
+}
+
+static int export_store(char *spec)
+{
+	dps_store_t store;
+	long long from_ms = 0;
+	long long to_ms = 0x7fffffffffffffffLL;
+	char *range = strchr(spec, ',');
+	if (range != NULL) {
+		*range++ = '\0';
+		if (sscanf(range, "%lld,%lld", &from_ms, &to_ms) != 2) {
+			fprintf(stderr, "Invalid range: %s\n", range);
+			return -EINVAL;
+		}
+	}
+	int rc = dps_store_open(&store, spec, false);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to open store %s: %s\n", spec, strerror(-rc));
+		return rc;
+	}
+	printf("timestamp_ms,v_in,v_out,i_out,output_enabled,temp_shutdown,temp1,temp2\n");
+	rc = dps_store_read(&store, from_ms, to_ms, print_csv_sample, NULL);
+	dps_store_close(&store);
+	return rc < 0 ? rc : 0;
+}
+
+static int run_sweep(char *spec)
+{
+	dps_sweep_t sweep;
+	dps_sweep_result_t result;
+	char param[8];
+	long settle_ms;
+	if (sscanf(spec, "%7[^,],%d,%d,%d,%ld,%d", param, &sweep.start, &sweep.stop, &sweep.step, &settle_ms, &sweep.samples) != 6) {
+		fprintf(stderr, "Invalid sweep: %s\n", spec);
+		return -EINVAL;
+	}
+	sweep.param = param;
+	sweep.settle_us = settle_ms * 1000;
+
+	int points = dps_sweep_points(&sweep);
+	if (points < 0)
+		return points;
+	result.capacity = points;
+	result.setpoint = calloc(points, sizeof(int));
+	result.v_out = calloc(points, sizeof(double));
+	result.i_out = calloc(points, sizeof(double));
+	result.timestamp_us = calloc(points, sizeof(long));
+
+	int rc = -ENOMEM;
+	if (result.setpoint && result.v_out && result.i_out && result.timestamp_us) {
+		rc = dps_sweep(&sweep, &result);
+		printf("time_ms,%s,v_out,i_out\n", param);
+		for (int i = 0; i < result.count; i++)
+			printf("%.3f,%d,%.1f,%.1f\n", (double) result.timestamp_us[i] / 1000, result.setpoint[i], result.v_out[i], result.i_out[i]);
+		if (rc < 0)
+			fprintf(stderr, "Sweep aborted: %s\n", strerror(-rc));
+	}
+	free(result.setpoint);
+	free(result.v_out);
+	free(result.i_out);
+	free(result.timestamp_us);
+	return rc;
+}
+
+static int run_sequence(const char *file_name)
+{
+	dps_seq_step_t *steps;
+	int count = load_sequence(file_name, &steps);
+	if (count <= 0)
+		return count < 0 ? count : -EINVAL;
+
+	int rc = dps_sequence_prepare(steps, count);
+	if (rc == 0)
+		rc = dps_sequence_run(steps, count);
+	if (rc >= 0) {
+		printf("Step   Planned (ms)   Issued (ms)   Late (us)   Result\n");
+		for (int i = 0; i < count; i++)
+			printf("%4d   %12.3f   %11.3f   %9ld   %s\n", i,
+				(double) steps[i].offset_us / 1000, (double) steps[i].issued_us / 1000,
+				steps[i].issued_us - steps[i].offset_us, steps[i].rc == 0 ? "OK" : "FAILED");
+	} else {
+		printf("Failed to run sequence: %s\n", strerror(-rc));
+	}
+	free_sequence(steps, count);
+	return rc;
 }
 
 int main(int argc, char *argv[])
@@ -63,11 +446,24 @@ int main(int argc, char *argv[])
 	bool c_help = false;
 	bool c_upgrade = false;
 	bool c_version = false;
+	bool c_daemon = false;
+	bool c_watch = false;
+	char *sequence_file = NULL;
+	char *sweep_spec = NULL;
+	char *record_file = NULL;
+	char *publish_segment = NULL;
+	char *monitor_segment = NULL;
+	char *raw_commands[MAX_RAW_COMMANDS];
+	int raw_count = 0;
+	char *export_spec = NULL;
+	int record_interval = 1000;
+	char *fleet_manifest = NULL;
+	int fleet_workers = 8;
 	int voltage = -1;
 	int current = -1;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "B:b:c:d:hilLmoOpsqvV:U:")) != -1) {
+	while ((opt = getopt(argc, argv, "B:b:c:d:DE:F:hij:lLmM:oOpP:R:sS:qT:vV:U:wW:X:")) != -1) {
 		switch(opt) {
 			case 'B':
 				lcd_brightness = atoi(optarg);
@@ -81,12 +477,24 @@ int main(int argc, char *argv[])
 			case 'd':
 				serial_device = optarg;
 				break;
+			case 'D':
+				c_daemon = true;
+				break;
+			case 'E':
+				export_spec = optarg;
+				break;
+			case 'F':
+				fleet_manifest = optarg;
+				break;
 			case 'h':
 				c_help = true;
 				break;
 			case 'i':
 				c_version = true;
 				break;
+			case 'j':
+				fleet_workers = atoi(optarg);
+				break;
 			case 'l':
 				c_unlock = true;
 				break;
@@ -108,15 +516,40 @@ int main(int argc, char *argv[])
 			case 's':
 				c_display_setting = true;
 				break;
+			case 'R':
+				record_file = optarg;
+				break;
+			case 'P':
+				publish_segment = optarg;
+				break;
+			case 'M':
+				monitor_segment = optarg;
+				break;
+			case 'X':
+				if (raw_count < MAX_RAW_COMMANDS)
+					raw_commands[raw_count++] = optarg;
+				break;
+			case 'S':
+				sequence_file = optarg;
+				break;
 			case 'q':
 				c_query = true;
 				break;
+			case 'T':
+				record_interval = atoi(optarg);
+				break;
 			case 'v':
 				verbose = true;
 				break;
 			case 'V':
 				voltage = atoi(optarg);
 				break;
+			case 'w':
+				c_watch = true;
+				break;
+			case 'W':
+				sweep_spec = optarg;
+				break;
 			case 'U':
 				c_upgrade = true;
 				firmware_file = optarg;
@@ -127,13 +560,51 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	int rc = dps_init(serial_device, baudrate, verbose);
+	if (export_spec != NULL)
+		return export_store(export_spec);
+
+	if (monitor_segment != NULL)
+		return print_published(monitor_segment);
+
+	if (fleet_manifest != NULL) {
+		fleet_op_t op = {
+			.query = c_query,
+			.voltage = voltage,
+			.current = current,
+			.power = c_power_on ? 1 : (c_power_off ? 0 : -1),
+		};
+		return run_fleet(fleet_manifest, fleet_workers, &op, c_upgrade ? firmware_file : NULL);
+	}
+
+	char socket_path[108];
+	daemon_socket_path(serial_device, socket_path, sizeof(socket_path));
+	if (c_daemon) {
+		// reopen the tty if the adapter is replugged, fail requests meanwhile
+		dps_link_supervision_t supervision = { .policy = DPS_LINK_FAIL_FAST };
+		int rc = dps_init(serial_device, baudrate, verbose);
+		if (rc < 0)
+			return rc;
+		dps_supervise(&supervision);
+		return daemon_run(socket_path);
+	}
+
+	// use a running daemon for this device if there is one
+	int rc = daemon_connect(socket_path);
+	if (rc >= 0)
+		rc = dps_init_fd(rc, verbose);
+	else if (strncmp(serial_device, "udp:", 4) == 0)
+		rc = init_udp(serial_device + 4, verbose);
+	else
+		rc = dps_init(serial_device, baudrate, verbose);
 	if (rc < 0)
 		return rc;
 
 	if (c_upgrade) {
 		cb_upgrade_progress cb_prog = print_upgrade_progress;
-		rc = dps_upgrade(firmware_file, cb_prog);
+		long image_size;
+		__uint8_t *image = load_image(firmware_file, &image_size);
+		rc = image != NULL ? dps_upgrade_image(image, image_size, cb_prog) : -EIO;
+		free(image);
 		if (rc == 0)
 			printf("\nDPS firmware upgraded successful.\n");
 		else
@@ -147,8 +618,7 @@ int main(int argc, char *argv[])
                 if (rc == 0) {
                         printf("Boot version : %s\n", version.bootloader_ver);
                         printf("App version  : %s\n", version.firmware_ver);
-                        free(version.bootloader_ver);
-                        free(version.firmware_ver);
+                        dps_free_version(&version);
                 } else {
                         printf("Failed to get versions from DPS\n");
                 }
@@ -163,6 +633,10 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	for (int i = 0; i < raw_count; i++) {
+		rc = raw_transact(raw_commands[i]);
+	}
+
 	if (c_unlock) {
 		printf("DPS %s\n", dps_lock(false) == 0 ? "unlocked" : "failed to unlock");
 	}
@@ -195,6 +669,14 @@ int main(int argc, char *argv[])
 			printf("Power output OFF\n");
 	}
 
+	if (sequence_file != NULL) {
+		run_sequence(sequence_file);
+	}
+
+	if (sweep_spec != NULL) {
+		run_sweep(sweep_spec);
+	}
+
 	if (c_lock) {
 		printf("DPS %s\n", dps_lock(true) == 0 ? "locked" : "failed to lock");
 	}
@@ -222,6 +704,18 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (c_watch) {
+		watch_events();
+	}
+
+	if (record_file != NULL) {
+		record_store(record_file, record_interval);
+	}
+
+	if (publish_segment != NULL) {
+		publish_state(publish_segment, serial_device, record_interval);
+	}
+
 	if (c_upgrade) {
 		//TODO: implement
 	}
@@ -0,0 +1,255 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * dpsemu, measures how libopendps copes with a bad link.
+ * A forked emulator serves a pseudo-terminal with the fault profile given
+ * by -f while the parent drives a fixed command mix through the library on
+ * the slave side. The report lists per command failure rates and latency
+ * percentiles, the goodput, and the faults that were injected. With -e only
+ * the emulator runs, for use with dpsctl or any other client.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "opendps/opendps.h"
+#include "opendps/link.h"
+#include "linkemu.h"
+
+typedef struct command_t {
+	const char *name;
+	int bytes;				// unescaped request and response, without CRC
+	long count;
+	long ok;
+	double *latency_ms;
+} command_t;
+
+static command_t commands[] = {
+	{ "ping", 1 + 2 },
+	{ "query", 1 + 14 },
+	{ "voltage", 8 + 2 },
+	{ "current", 8 + 2 },
+	{ "power", 2 + 2 },
+};
+#define NUM_COMMANDS (int)(sizeof(commands) / sizeof(commands[0]))
+
+static volatile sig_atomic_t running = 1;
+
+static void stop_running(int sig)
+{
+	running = 0;
+}
+
+static void print_usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-v] [-e] [-d upstream device] [-b baudrate] [-n commands] [-f seed=n,baud=n,jitter=us,drop=p,flip=p,stray=p,truncate=p]\n", program);
+}
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+static int run_command(int index, int round)
+{
+	dps_query_t status;
+	switch (index) {
+	case 0:
+		return dps_ping();
+	case 1:
+		return dps_query(&status);
+	case 2:
+		return dps_voltage(5000 + (round % 2) * 100);
+	case 3:
+		return dps_current(1000 + (round % 2) * 100);
+	default:
+		return dps_power(round % 2);
+	}
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, long count, int pct)
+{
+	return count > 0 ? sorted[(count - 1) * pct / 100] : 0;
+}
+
+static void print_report(const emu_profile_t *profile, const emu_faults_t *faults, const dps_link_health_t *health, double duration_ms)
+{
+	long ok = 0, bytes = 0;
+	printf("Profile : seed %lu, %d baud, jitter %d us, drop %g, flip %g, stray %g, truncate %g\n",
+	       profile->seed, profile->baudrate, profile->jitter_us, profile->drop, profile->flip, profile->stray, profile->truncate);
+	printf("Injected: %ld frames, %ld bytes, %ld dropped, %ld flipped, %ld stray, %ld truncated\n",
+	       faults->frames, faults->bytes, faults->dropped, faults->flipped, faults->stray, faults->truncated);
+	printf("%-8s %6s %6s %6s %7s %8s %8s %8s %8s\n", "Command", "count", "ok", "failed", "fail%", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	for (int i = 0; i < NUM_COMMANDS; i++) {
+		command_t *cmd = &commands[i];
+		qsort(cmd->latency_ms, cmd->count, sizeof(double), compare_double);
+		printf("%-8s %6ld %6ld %6ld %6.2f%% %8.1f %8.1f %8.1f %8.1f\n", cmd->name, cmd->count, cmd->ok, cmd->count - cmd->ok,
+		       cmd->count > 0 ? 100.0 * (cmd->count - cmd->ok) / cmd->count : 0,
+		       percentile(cmd->latency_ms, cmd->count, 50), percentile(cmd->latency_ms, cmd->count, 90),
+		       percentile(cmd->latency_ms, cmd->count, 99), percentile(cmd->latency_ms, cmd->count, 100));
+		ok += cmd->ok;
+		bytes += cmd->ok * cmd->bytes;
+	}
+	printf("Goodput : %.1f commands/s, %.1f B/s over %.1f s\n", ok * 1000 / duration_ms, bytes * 1000 / duration_ms, duration_ms / 1000);
+	printf("Library : %ld timeouts, %ld CRC errors\n", health->timeouts, health->crc_errors);
+}
+
+static int benchmark(int master, const char *slave, int upstream, const emu_profile_t *profile, int baudrate, long rounds, bool verbose)
+{
+	emu_faults_t faults;
+	dps_link_health_t health;
+	struct timespec start, before, after;
+	int report[2];
+	memset(&faults, 0, sizeof(faults));
+	if (pipe(report) < 0)
+		return -errno;
+
+	pid_t pid = fork();
+	if (pid < 0)
+		return -errno;
+	if (pid == 0) {
+		close(report[0]);
+		signal(SIGTERM, stop_running);
+		emu_run(master, upstream, profile, &running, &faults);
+		if (write(report[1], &faults, sizeof(faults)) < 0)
+			_exit(1);
+		_exit(0);
+	}
+	close(report[1]);
+	close(master);
+
+	// expected errors would drown the report
+	if (!verbose)
+		dps_set_diagnostics(NULL, NULL);
+	int rc = dps_init(slave, baudrate, verbose);
+	if (rc == 0) {
+		// every write has to reach the link to be measured
+		dps_shadow_force(true);
+		for (int i = 0; i < NUM_COMMANDS; i++)
+			commands[i].latency_ms = calloc(rounds / NUM_COMMANDS + 1, sizeof(double));
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long round = 0; round < rounds && running; round++) {
+			command_t *cmd = &commands[round % NUM_COMMANDS];
+			clock_gettime(CLOCK_MONOTONIC, &before);
+			int result = run_command(round % NUM_COMMANDS, round / NUM_COMMANDS);
+			clock_gettime(CLOCK_MONOTONIC, &after);
+			cmd->latency_ms[cmd->count++] = elapsed_ms(&before, &after);
+			if (result == 0)
+				cmd->ok++;
+		}
+		dps_link_health(&health);
+		dps_close();
+	}
+
+	kill(pid, SIGTERM);
+	if (read(report[0], &faults, sizeof(faults)) != sizeof(faults))
+		fprintf(stderr, "No fault report from the emulator\n");
+	close(report[0]);
+	waitpid(pid, NULL, 0);
+	if (rc == 0)
+		print_report(profile, &faults, &health, elapsed_ms(&start, &after));
+	for (int i = 0; i < NUM_COMMANDS; i++)
+		free(commands[i].latency_ms);
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	emu_profile_t profile = { .seed = 1, .baudrate = 9600 };
+	emu_faults_t faults;
+	char slave[64];
+	char *upstream_device = NULL;
+	int baudrate = 9600;
+	long rounds = 500;
+	bool emulate = false;
+	bool verbose = false;
+	int master;
+	int upstream = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:d:ef:hn:v")) != -1) {
+		switch (opt) {
+			case 'b':
+				baudrate = atoi(optarg);
+				break;
+			case 'd':
+				upstream_device = optarg;
+				break;
+			case 'e':
+				emulate = true;
+				break;
+			case 'f':
+				if (emu_parse_profile(optarg, &profile) < 0) {
+					fprintf(stderr, "Invalid fault profile\n");
+					return -EINVAL;
+				}
+				break;
+			case 'n':
+				rounds = atol(optarg);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				print_usage(argv[0]);
+				return opt == 'h' ? 0 : -EINVAL;
+		}
+	}
+
+	if (upstream_device != NULL) {
+		upstream = dps_open_tty(upstream_device, baudrate);
+		if (upstream < 0)
+			return upstream;
+	}
+	int rc = emu_open(&master, slave, sizeof(slave));
+	if (rc < 0) {
+		fprintf(stderr, "Failed to open pseudo-terminal: %s\n", strerror(-rc));
+		return rc;
+	}
+
+	if (!emulate)
+		return benchmark(master, slave, upstream, &profile, baudrate, rounds, verbose);
+
+	printf("%s\n", slave);
+	fflush(stdout);
+	signal(SIGINT, stop_running);
+	signal(SIGTERM, stop_running);
+	rc = emu_run(master, upstream, &profile, &running, &faults);
+	printf("Injected: %ld frames, %ld bytes, %ld dropped, %ld flipped, %ld stray, %ld truncated\n",
+	       faults.frames, faults.bytes, faults.dropped, faults.flipped, faults.stray, faults.truncated);
+	return rc;
+}
@@ -0,0 +1,270 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "fleet.h"
+
+typedef struct device_t {
+	char path[PATH_MAX];
+	int baudrate;
+	pid_t pid;
+	bool done;
+	int progress;
+	int rc;
+	dps_query_t status;
+} device_t;
+
+typedef struct fleet_msg_t {
+	int index;
+	int progress;
+	bool done;
+	int rc;
+	dps_query_t status;
+} fleet_msg_t;
+
+// worker side, valid in forked children only
+static int report_fd = -1;
+static int report_index = -1;
+
+static void report(int progress, bool done, int rc, const dps_query_t *status)
+{
+	fleet_msg_t msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.index = report_index;
+	msg.progress = progress;
+	msg.done = done;
+	msg.rc = rc;
+	if (status != NULL)
+		msg.status = *status;
+	// messages are smaller than PIPE_BUF so writes from workers do not interleave
+	if (write(report_fd, &msg, sizeof(msg)) < 0)
+		_exit(EXIT_FAILURE);
+}
+
+static void report_progress(__uint8_t progress)
+{
+	report(progress, false, 0, NULL);
+}
+
+static int run_device(const device_t *device, const fleet_op_t *op, dps_query_t *status)
+{
+	int rc = dps_init(device->path, device->baudrate, false);
+	if (rc < 0)
+		return rc;
+	if (op->image != NULL)
+		return dps_upgrade_image(op->image, op->image_size, report_progress);
+	if (op->voltage >= 0 && (rc = dps_voltage(op->voltage)) < 0)
+		return rc;
+	if (op->current >= 0 && (rc = dps_current(op->current)) < 0)
+		return rc;
+	if (op->power >= 0 && (rc = dps_power(op->power == 1)) < 0)
+		return rc;
+	if (op->query)
+		return dps_query(status);
+	return dps_ping();
+}
+
+static pid_t spawn(device_t *devices, int index, const fleet_op_t *op, int pipe_fd)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		dps_query_t status;
+		int null_fd = open("/dev/null", O_WRONLY);
+		// keep library diagnostics out of the table
+		if (null_fd >= 0)
+			dup2(null_fd, STDOUT_FILENO);
+		report_fd = pipe_fd;
+		report_index = index;
+		memset(&status, 0, sizeof(status));
+		int rc = run_device(&devices[index], op, &status);
+		report(100, true, rc, op->query ? &status : NULL);
+		_exit(rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	return pid;
+}
+
+static int load_manifest(const char *manifest, device_t **devices)
+{
+	FILE *file = fopen(manifest, "r");
+	char line[PATH_MAX + 32];
+	int count = 0;
+	int line_no = 0;
+	*devices = NULL;
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open manifest: %s\n", manifest);
+		return -EIO;
+	}
+	while (fgets(line, sizeof(line), file) != NULL) {
+		int baudrate = 115200;
+		line_no++;
+		// a cut off device path would fail to open with a misleading error
+		if (strchr(line, '\n') == NULL && !feof(file)) {
+			fprintf(stderr, "%s:%d: line too long\n", manifest, line_no);
+			free(*devices);
+			*devices = NULL;
+			fclose(file);
+			return -ENAMETOOLONG;
+		}
+		char *path = strtok(line, " \t\r\n");
+		char *baud = strtok(NULL, " \t\r\n");
+		if (path == NULL || path[0] == '#')
+			continue;
+		if (strlen(path) >= PATH_MAX) {
+			fprintf(stderr, "%s:%d: device path too long\n", manifest, line_no);
+			free(*devices);
+			*devices = NULL;
+			fclose(file);
+			return -ENAMETOOLONG;
+		}
+		if (baud != NULL)
+			baudrate = atoi(baud);
+		device_t *tmp = realloc(*devices, (count + 1) * sizeof(device_t));
+		if (tmp == NULL)
+			break;
+		*devices = tmp;
+		memset(&tmp[count], 0, sizeof(device_t));
+		strcpy(tmp[count].path, path);
+		tmp[count].baudrate = baudrate;
+		tmp[count].pid = -1;
+		count++;
+	}
+	fclose(file);
+	return count;
+}
+
+static void print_progress(const device_t *devices, int count, int running)
+{
+	int done = 0;
+	int failed = 0;
+	int progress = 0;
+	for (int i = 0; i < count; i++) {
+		done += devices[i].done;
+		failed += devices[i].done && devices[i].rc != 0;
+		progress += devices[i].progress;
+	}
+	printf("\rDevices: %d/%d done, %d failed, %d running, total %3d%%", done, count, failed, running, progress / count);
+	fflush(stdout);
+}
+
+static void print_results(const device_t *devices, int count, const fleet_op_t *op)
+{
+	printf("\n\n%-24s %8s   %-8s %s\n", "Device", "Baud", "Result", op->query ? "V in     V out    I out    Output" : "");
+	for (int i = 0; i < count; i++) {
+		const device_t *device = &devices[i];
+		printf("%-24s %8d   %-8s", device->path, device->baudrate, device->rc == 0 ? "OK" : strerror(-device->rc));
+		if (op->query && device->rc == 0)
+			printf(" %-8.2f %-8.2f %-8.3f %s", (double) device->status.v_in / 1000, (double) device->status.v_out / 1000,
+				(double) device->status.i_out / 1000, device->status.output_enabled ? "ON" : "OFF");
+		printf("\n");
+	}
+}
+
+int fleet_run(const char *manifest, const fleet_op_t *op, int workers)
+{
+	device_t *devices;
+	int pipe_fds[2];
+	int count = load_manifest(manifest, &devices);
+	int next = 0;
+	int running = 0;
+	int failed = 0;
+	if (count <= 0)
+		return count < 0 ? count : -EINVAL;
+	if (pipe(pipe_fds) != 0) {
+		free(devices);
+		return -errno;
+	}
+
+	while (next < count || running > 0) {
+		while (next < count && running < workers) {
+			devices[next].pid = spawn(devices, next, op, pipe_fds[1]);
+			if (devices[next].pid < 0) {
+				devices[next].done = true;
+				devices[next].rc = -errno;
+			} else {
+				running++;
+			}
+			next++;
+		}
+
+		struct pollfd pfd = { .fd = pipe_fds[0], .events = POLLIN };
+		if (poll(&pfd, 1, 100) > 0) {
+			fleet_msg_t msg;
+			if (read(pipe_fds[0], &msg, sizeof(msg)) == sizeof(msg) && msg.index >= 0 && msg.index < count) {
+				device_t *device = &devices[msg.index];
+				device->progress = msg.progress;
+				if (msg.done) {
+					device->done = true;
+					device->rc = msg.rc;
+					device->status = msg.status;
+				}
+			}
+		}
+
+		// reap workers, a worker that died without reporting has failed
+		pid_t pid;
+		int status;
+		while (running > 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (int i = 0; i < count; i++) {
+				if (devices[i].pid != pid)
+					continue;
+				devices[i].pid = -1;
+				if (!devices[i].done && !(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)) {
+					devices[i].done = true;
+					devices[i].rc = -EIO;
+				}
+			}
+			running--;
+		}
+		print_progress(devices, count, running);
+	}
+
+	// pick up reports still queued in the pipe
+	fleet_msg_t msg;
+	close(pipe_fds[1]);
+	while (read(pipe_fds[0], &msg, sizeof(msg)) == sizeof(msg)) {
+		if (msg.index >= 0 && msg.index < count && msg.done) {
+			devices[msg.index].done = true;
+			devices[msg.index].rc = msg.rc;
+			devices[msg.index].status = msg.status;
+			devices[msg.index].progress = msg.progress;
+		}
+	}
+	close(pipe_fds[0]);
+
+	print_progress(devices, count, 0);
+	print_results(devices, count, op);
+	for (int i = 0; i < count; i++)
+		failed += devices[i].rc != 0;
+	free(devices);
+	return failed;
+}
@@ -0,0 +1,50 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * dpsctl fleet mode.
+ * Runs one operation on every device listed in a manifest. Each device is
+ * handled by a forked worker, since libopendps drives one link per
+ * process, and at most a given number of workers run at once. Workers
+ * report progress and results to the parent over a shared pipe.
+ */
+
+#ifndef __DPSCTL_FLEET_H__
+#define __DPSCTL_FLEET_H__
+
+#include <stdbool.h>
+#include "opendps/opendps.h"
+
+typedef struct fleet_op_t {
+	bool query;
+	int voltage;				// -1 to leave unchanged
+	int current;				// -1 to leave unchanged
+	int power;				// -1 to leave unchanged, 0 off, 1 on
+	const __uint8_t *image;			// firmware image to upgrade to, or NULL
+	long image_size;
+} fleet_op_t;
+
+int fleet_run(const char *manifest, const fleet_op_t *op, int workers);
+
+#endif //__DPSCTL_FLEET_H__
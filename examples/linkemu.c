@@ -0,0 +1,326 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE				// posix_openpt() and friends
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "linkemu.h"
+
+#define QUEUE_SIZE 4096
+#define MAX_CUT 16				// truncated frames keep 1..MAX_CUT bytes
+#define IDLE_POLL_MS 100
+
+typedef struct direction_t {
+	__uint64_t rng;
+	__int64_t next_free_ns;			// when the line is free for the next byte
+	bool cutting;
+	int cut_after;
+	int head;
+	int len;
+	__uint8_t data[QUEUE_SIZE];
+	__int64_t due_ns[QUEUE_SIZE];
+} direction_t;
+
+typedef struct sim_t {
+	__uint8_t frame[256];
+	int len;
+	bool in_frame;
+	int voltage;
+	int current;
+	bool output;
+	bool locked;
+	int brightness;
+	__uint8_t screen;
+} sim_t;
+
+static __int64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (__int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// xorshift64*, reproducible for a given seed
+static __uint64_t rng_next(__uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static bool chance(__uint64_t *state, double p)
+{
+	return p > 0 && (rng_next(state) >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+int emu_parse_profile(char *spec, emu_profile_t *profile)
+{
+	for (char *tok = strtok(spec, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		char *value = strchr(tok, '=');
+		if (value == NULL)
+			return -EINVAL;
+		*value++ = '\0';
+		if (strcmp(tok, "seed") == 0)
+			profile->seed = strtoul(value, NULL, 0);
+		else if (strcmp(tok, "baud") == 0)
+			profile->baudrate = atoi(value);
+		else if (strcmp(tok, "jitter") == 0)
+			profile->jitter_us = atoi(value);
+		else if (strcmp(tok, "drop") == 0)
+			profile->drop = atof(value);
+		else if (strcmp(tok, "flip") == 0)
+			profile->flip = atof(value);
+		else if (strcmp(tok, "stray") == 0)
+			profile->stray = atof(value);
+		else if (strcmp(tok, "truncate") == 0)
+			profile->truncate = atof(value);
+		else
+			return -EINVAL;
+	}
+	return 0;
+}
+
+int emu_open(int *master, char *slave_path, size_t size)
+{
+	struct termios tty;
+	*master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (*master < 0)
+		return -errno;
+	if (grantpt(*master) < 0 || unlockpt(*master) < 0 || ptsname(*master) == NULL) {
+		close(*master);
+		return -errno;
+	}
+	snprintf(slave_path, size, "%s", ptsname(*master));
+	// no echo or line discipline until the application configures the tty
+	if (tcgetattr(*master, &tty) == 0) {
+		cfmakeraw(&tty);
+		tcsetattr(*master, TCSANOW, &tty);
+	}
+	return 0;
+}
+
+static void queue_push(direction_t *dir, __uint8_t byte, const emu_profile_t *profile, __int64_t now)
+{
+	if (dir->len == QUEUE_SIZE)
+		return;
+	__int64_t start = now > dir->next_free_ns ? now : dir->next_free_ns;
+	if (byte == _SOF && profile->jitter_us > 0)
+		start += (__int64_t)(rng_next(&dir->rng) % profile->jitter_us) * 1000;
+	// 8N1, ten bit times per byte
+	dir->next_free_ns = start + (profile->baudrate > 0 ? 10000000000LL / profile->baudrate : 0);
+	int slot = (dir->head + dir->len) % QUEUE_SIZE;
+	dir->data[slot] = byte;
+	dir->due_ns[slot] = dir->next_free_ns;
+	dir->len++;
+}
+
+static void inject(direction_t *dir, __uint8_t byte, const emu_profile_t *profile, emu_faults_t *faults, __int64_t now)
+{
+	faults->bytes++;
+	if (byte == _SOF) {
+		faults->frames++;
+		dir->cutting = chance(&dir->rng, profile->truncate);
+		if (dir->cutting)
+			dir->cut_after = 1 + rng_next(&dir->rng) % MAX_CUT;
+	}
+	if (dir->cutting) {
+		if (byte == _EOF)
+			dir->cutting = false;
+		// frames shorter than the cut pass intact
+		if (dir->cut_after-- <= 0) {
+			if (dir->cut_after == -1)
+				faults->truncated++;
+			return;
+		}
+	}
+	if (chance(&dir->rng, profile->stray)) {
+		queue_push(dir, rng_next(&dir->rng) & 1 ? _SOF : _EOF, profile, now);
+		faults->stray++;
+	}
+	if (chance(&dir->rng, profile->drop)) {
+		faults->dropped++;
+		return;
+	}
+	if (chance(&dir->rng, profile->flip)) {
+		byte ^= 1 << (rng_next(&dir->rng) % 8);
+		faults->flipped++;
+	}
+	queue_push(dir, byte, profile, now);
+}
+
+static int sim_set_parameters(sim_t *sim, const __uint8_t *cmd, int len)
+{
+	int idx = 1;
+	while (idx < len) {
+		const char *name = (const char *) cmd + idx;
+		idx += strnlen(name, len - idx) + 1;
+		if (idx >= len)
+			return 0;
+		const char *value = (const char *) cmd + idx;
+		idx += strnlen(value, len - idx) + 1;
+		if (strcmp(name, "u") == 0)
+			sim->voltage = atoi(value);
+		else if (strcmp(name, "i") == 0)
+			sim->current = atoi(value);
+		else
+			return 0;
+	}
+	return 1;
+}
+
+// reply of a well behaved DPS, returns its length
+static int sim_respond(sim_t *sim, const __uint8_t *cmd, int len, __uint8_t *resp)
+{
+	int idx = 2;
+	resp[0] = cmd[0] | CMD_RESPONSE;
+	resp[1] = CMD_STATUS_SUCC;
+	if (cmd[0] == CMD_QUERY) {
+		int v_out = sim->output ? sim->voltage : 0;
+		int i_out = sim->output ? sim->current / 2 : 0;
+		__uint8_t status[] = { 12000 >> 8, 12000 & 0xff, v_out >> 8, v_out & 0xff, i_out >> 8, i_out & 0xff,
+				       sim->output, 0xff, 0xff, 0xff, 0xff, 0 };
+		memcpy(resp + idx, status, sizeof(status));
+		idx += sizeof(status);
+	} else if (cmd[0] == CMD_SET_PARAMETERS) {
+		resp[1] = sim_set_parameters(sim, cmd, len);
+	} else if (cmd[0] == CMD_ENABLE_OUTPUT && len == 2) {
+		sim->output = cmd[1];
+	} else if (cmd[0] == CMD_LOCK && len == 2) {
+		sim->locked = cmd[1];
+	} else if (cmd[0] == CMD_SET_BRIGHTNESS && len == 2) {
+		sim->brightness = cmd[1];
+	} else if (cmd[0] == CMD_CHANGE_SCREEN && len == 2) {
+		sim->screen = cmd[1];
+	} else if (cmd[0] == CMD_VERSION) {
+		memcpy(resp + idx, "emu-boot\0emu-app", 17);
+		idx += 17;
+	} else if (cmd[0] != CMD_PING) {
+		resp[1] = 0;
+	}
+	return idx;
+}
+
+static void sim_feed(sim_t *sim, __uint8_t byte, direction_t *reply, const emu_profile_t *profile, emu_faults_t *faults, __int64_t now)
+{
+	__uint8_t cmd[256];
+	__uint8_t resp[64];
+	__uint8_t frame[2 * sizeof(resp) + 6];
+	if (byte == _SOF) {
+		sim->in_frame = true;
+		sim->len = 0;
+		return;
+	}
+	if (!sim->in_frame)
+		return;
+	if (byte != _EOF) {
+		if (sim->len < (int) sizeof(sim->frame))
+			sim->frame[sim->len++] = byte;
+		return;
+	}
+	sim->in_frame = false;
+	// a real DPS ignores frames that fail the CRC
+	int len = dps_decode_frame(sim->frame, sim->len, cmd, sizeof(cmd));
+	if (len <= 0)
+		return;
+	len = dps_encode_frame(resp, sim_respond(sim, cmd, len, resp), frame, sizeof(frame));
+	for (int i = 0; i < len; i++)
+		inject(reply, frame[i], profile, faults, now);
+}
+
+int emu_run(int master, int upstream, const emu_profile_t *profile, volatile sig_atomic_t *running, emu_faults_t *faults)
+{
+	static direction_t to_dps, to_app;
+	sim_t sim = { .voltage = 5000, .current = 1000 };
+	__uint8_t buf[QUEUE_SIZE];
+
+	memset(&to_dps, 0, sizeof(to_dps));
+	memset(&to_app, 0, sizeof(to_app));
+	to_dps.rng = profile->seed * 2 + 1;
+	to_app.rng = profile->seed * 2 + 2;
+	memset(faults, 0, sizeof(*faults));
+
+	// keep the slave open, or the master hangs up whenever no application has it
+	int hold = open(ptsname(master), O_RDWR | O_NOCTTY);
+	while (*running) {
+		__int64_t now = now_ns();
+		while (to_dps.len > 0 && to_dps.due_ns[to_dps.head] <= now) {
+			__uint8_t byte = to_dps.data[to_dps.head];
+			to_dps.head = (to_dps.head + 1) % QUEUE_SIZE;
+			to_dps.len--;
+			if (upstream >= 0) {
+				if (write(upstream, &byte, 1) < 0)
+					return -errno;
+			} else {
+				sim_feed(&sim, byte, &to_app, profile, faults, now);
+			}
+		}
+		int len = 0;
+		while (to_app.len > 0 && to_app.due_ns[to_app.head] <= now) {
+			buf[len++] = to_app.data[to_app.head];
+			to_app.head = (to_app.head + 1) % QUEUE_SIZE;
+			to_app.len--;
+		}
+		if (len > 0 && write(master, buf, len) < 0)
+			return -errno;
+
+		// sleep until the next byte is due or input arrives
+		__int64_t next = -1;
+		if (to_dps.len > 0)
+			next = to_dps.due_ns[to_dps.head];
+		if (to_app.len > 0 && (next < 0 || to_app.due_ns[to_app.head] < next))
+			next = to_app.due_ns[to_app.head];
+		int timeout_ms = next < 0 ? IDLE_POLL_MS : (int)((next - now + 999999) / 1000000);
+		struct pollfd fds[2] = {
+			{ .fd = master, .events = POLLIN },
+			{ .fd = upstream, .events = POLLIN },
+		};
+		if (poll(fds, upstream >= 0 ? 2 : 1, timeout_ms) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		now = now_ns();
+		if (fds[0].revents & POLLIN) {
+			len = read(master, buf, sizeof(buf));
+			for (int i = 0; i < len; i++)
+				inject(&to_dps, buf[i], profile, faults, now);
+		}
+		if (upstream >= 0 && (fds[1].revents & POLLIN)) {
+			len = read(upstream, buf, sizeof(buf));
+			for (int i = 0; i < len; i++)
+				inject(&to_app, buf[i], profile, faults, now);
+		}
+	}
+	if (hold >= 0)
+		close(hold);
+	return 0;
+}
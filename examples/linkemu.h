@@ -0,0 +1,65 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * dpsemu link emulator.
+ * Sits on the master side of a pseudo-terminal pair. Bytes written by the
+ * application to the slave are passed to a simulated DPS, or to a real
+ * one on an upstream tty, and the replies come back the same way. Both
+ * directions are paced at a configured baud rate and run through a seeded
+ * fault injector, so a given profile reproduces the same byte level faults
+ * on every run.
+ */
+
+#ifndef __DPSCTL_LINKEMU_H__
+#define __DPSCTL_LINKEMU_H__
+
+#include <signal.h>
+#include <stddef.h>
+#include "opendps/opendps.h"
+
+typedef struct emu_profile_t {
+	unsigned long seed;
+	int baudrate;				// 0 for no pacing
+	int jitter_us;				// extra delay per frame, uniform in [0, jitter_us)
+	double drop;				// per byte
+	double flip;				// per byte, flips one random bit
+	double stray;				// per byte, inserts a stray _SOF or _EOF
+	double truncate;			// per frame, the rest is cut at a random byte
+} emu_profile_t;
+
+typedef struct emu_faults_t {
+	long frames;
+	long bytes;
+	long dropped;
+	long flipped;
+	long stray;
+	long truncated;
+} emu_faults_t;
+
+int emu_parse_profile(char *spec, emu_profile_t *profile);
+int emu_open(int *master, char *slave_path, size_t size);
+int emu_run(int master, int upstream, const emu_profile_t *profile, volatile sig_atomic_t *running, emu_faults_t *faults);
+
+#endif //__DPSCTL_LINKEMU_H__
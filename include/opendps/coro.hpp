@@ -0,0 +1,493 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * C++20 coroutine interface to libopendps.
+ * A single threaded epoll Reactor drives any number of AsyncDevices, each
+ * with its own tty, so conversations with many supplies overlap on one
+ * core:
+ *
+ *   opendps::Task<void> poll(opendps::AsyncDevice &dev)
+ *   {
+ *       co_await dev.set({{"u", 3300}, {"i", 1000}});
+ *       auto status = co_await dev.query();
+ *   }
+ *
+ *   reactor.spawn(poll(dev));
+ *   reactor.run();
+ *
+ * Every attempt of a command waits for its response until a deadline and
+ * is retried MAX_RETRY times like the blocking calls. A device handles one
+ * command at a time; a second concurrent command fails with -EBUSY.
+ */
+
+#ifndef __LIB_OPENDPS_CORO_HPP__
+#define __LIB_OPENDPS_CORO_HPP__
+
+#include <chrono>
+#include <cstring>
+#include <coroutine>
+#include <exception>
+#include <map>
+#include <optional>
+#include <sys/epoll.h>
+#include "opendps/opendps.hpp"
+#include "opendps/events.h"
+
+namespace opendps {
+
+using Clock = std::chrono::steady_clock;
+
+template <typename T>
+class Task;
+
+namespace detail {
+
+struct TaskPromiseBase {
+	std::coroutine_handle<> continuation = std::noop_coroutine();
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		template <typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+		{
+			return handle.promise().continuation;
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { std::terminate(); }
+};
+
+} // namespace detail
+
+// Lazily started coroutine, resumes its awaiter when done
+template <typename T>
+class Task {
+public:
+	struct promise_type : detail::TaskPromiseBase {
+		std::optional<T> value;
+
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		void return_value(T result) { value.emplace(std::move(result)); }
+	};
+
+	Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+	Task(const Task &) = delete;
+	~Task()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+	{
+		handle_.promise().continuation = awaiter;
+		return handle_;
+	}
+	T await_resume() { return std::move(*handle_.promise().value); }
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+template <>
+class Task<void> {
+public:
+	struct promise_type : detail::TaskPromiseBase {
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		void return_void() {}
+	};
+
+	Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+	Task(const Task &) = delete;
+	~Task()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+	{
+		handle_.promise().continuation = awaiter;
+		return handle_;
+	}
+	void await_resume() {}
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+class Reactor {
+public:
+	struct Waiter;
+	using Timers = std::multimap<Clock::time_point, Waiter *>;
+
+	struct Waiter {
+		std::coroutine_handle<> handle;
+		int fd = -1;				// -1 for a plain deadline
+		int error = 0;
+		bool has_timer = false;
+		Timers::iterator timer;
+	};
+
+	// True when fd is readable, otherwise error is -ETIMEDOUT, -ENXIO on hangup or -EIO
+	struct Wakeup {
+		int error;
+
+		explicit operator bool() const { return error == 0; }
+	};
+
+	struct WaitAwaiter {
+		Reactor &reactor;
+		Clock::time_point deadline;
+		Waiter waiter;
+
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			waiter.handle = handle;
+			return reactor.arm(&waiter, deadline);
+		}
+		Wakeup await_resume() const noexcept { return Wakeup{waiter.error}; }
+	};
+
+	Reactor() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {}
+	Reactor(const Reactor &) = delete;
+	Reactor &operator=(const Reactor &) = delete;
+	~Reactor()
+	{
+		if (epoll_fd_ >= 0)
+			::close(epoll_fd_);
+	}
+
+	// one shot while idle, so a hangup nobody waits for is reported once
+	int add(int fd)
+	{
+		epoll_event event{};
+		event.events = EPOLLONESHOT;
+		return epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == 0 ? 0 : -errno;
+	}
+
+	void remove(int fd) { epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr); }
+
+	WaitAwaiter readable(int fd, Clock::time_point deadline)
+	{
+		WaitAwaiter awaiter{*this, deadline, {}};
+		awaiter.waiter.fd = fd;
+		return awaiter;
+	}
+
+	WaitAwaiter sleep_until(Clock::time_point deadline) { return WaitAwaiter{*this, deadline, {}}; }
+	WaitAwaiter sleep_for(Clock::duration duration) { return sleep_until(Clock::now() + duration); }
+
+	// Start a task that runs until completion under run()
+	void spawn(Task<void> task)
+	{
+		tasks_++;
+		detach(*this, std::move(task));
+	}
+
+	// Run until all spawned tasks have completed
+	void run()
+	{
+		epoll_event events[64];
+		while (tasks_ > 0)
+		{
+			int timeout = -1;
+			if (!timers_.empty())
+			{
+				auto wait = std::chrono::ceil<std::chrono::milliseconds>(timers_.begin()->first - Clock::now());
+				timeout = wait.count() > 0 ? static_cast<int>(wait.count()) : 0;
+			}
+			int count = epoll_wait(epoll_fd_, events, 64, timeout);
+			for (int i = 0; i < count; i++)
+			{
+				if (events[i].data.ptr == nullptr)
+					continue;
+				int error = 0;
+				if (!(events[i].events & EPOLLIN))
+					error = (events[i].events & EPOLLERR) ? -EIO : -ENXIO;
+				wake(static_cast<Waiter *>(events[i].data.ptr), error);
+			}
+			auto now = Clock::now();
+			while (!timers_.empty() && timers_.begin()->first <= now)
+				wake(timers_.begin()->second, -ETIMEDOUT);
+		}
+	}
+
+private:
+	struct Detached {
+		struct promise_type {
+			Detached get_return_object() { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+
+	static Detached detach(Reactor &reactor, Task<void> task)
+	{
+		co_await task;
+		reactor.tasks_--;
+	}
+
+	bool arm(Waiter *waiter, Clock::time_point deadline)
+	{
+		if (waiter->fd >= 0)
+		{
+			epoll_event event{};
+			event.events = EPOLLIN | EPOLLONESHOT;
+			event.data.ptr = waiter;
+			if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, waiter->fd, &event) != 0)
+			{
+				waiter->error = -errno;
+				return false;
+			}
+		}
+		waiter->timer = timers_.emplace(deadline, waiter);
+		waiter->has_timer = true;
+		return true;
+	}
+
+	void wake(Waiter *waiter, int error)
+	{
+		if (waiter->fd >= 0)
+		{
+			epoll_event event{};
+			event.events = EPOLLONESHOT;
+			epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, waiter->fd, &event);
+		}
+		if (waiter->has_timer)
+		{
+			timers_.erase(waiter->timer);
+			waiter->has_timer = false;
+		}
+		waiter->error = error;
+		waiter->handle.resume();
+	}
+
+	int epoll_fd_;
+	int tasks_ = 0;
+	Timers timers_;
+};
+
+/*
+ * Parameters for AsyncDevice::set(), written as {{"u", 3300}, {"i", 1000}}.
+ * A fixed set of constructor arguments instead of std::initializer_list,
+ * since some compilers cannot keep an initializer_list temporary alive
+ * across co_await.
+ */
+class Params {
+public:
+	Params(dps_param_t p1, dps_param_t p2 = {}, dps_param_t p3 = {}, dps_param_t p4 = {}) : params_{p1, p2, p3, p4}
+	{
+		while (count_ < params_.size() && params_[count_].name != nullptr)
+			count_++;
+	}
+
+	const dps_param_t *data() const { return params_.data(); }
+	int size() const { return static_cast<int>(count_); }
+
+private:
+	std::array<dps_param_t, 4> params_;
+	std::size_t count_ = 0;
+};
+
+class AsyncDevice {
+public:
+	static Result<AsyncDevice> open(Reactor &reactor, const char *serial_device, int baud_rate)
+	{
+		int fd = dps_open_tty(serial_device, baud_rate);
+		if (fd < 0)
+			return Error{fd};
+		int rc = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0 ? reactor.add(fd) : -errno;
+		if (rc < 0)
+		{
+			::close(fd);
+			return Error{rc};
+		}
+		return AsyncDevice(reactor, fd);
+	}
+
+	AsyncDevice(AsyncDevice &&other) noexcept
+		: reactor_(other.reactor_), fd_(std::exchange(other.fd_, -1)), timeout_(other.timeout_) {}
+	AsyncDevice(const AsyncDevice &) = delete;
+	AsyncDevice &operator=(const AsyncDevice &) = delete;
+	~AsyncDevice()
+	{
+		if (fd_ >= 0)
+		{
+			reactor_->remove(fd_);
+			::close(fd_);
+		}
+	}
+
+	// Response deadline of each attempt
+	void timeout(Clock::duration timeout) { timeout_ = timeout; }
+
+	Task<Result<void>> ping() { return ack(transact(frame::ping, CMD_PING)); }
+	Task<Result<void>> power(bool enable) { return ack(transact(enable ? frame::power_on : frame::power_off, CMD_ENABLE_OUTPUT)); }
+	Task<Result<void>> lock(bool enable) { return ack(transact(enable ? frame::lock : frame::unlock, CMD_LOCK)); }
+
+	Task<Result<void>> set(const Params &params)
+	{
+		// encode now, the parameters may not outlive the call
+		std::uint8_t cmd[64];
+		frame::Frame<sizeof(cmd)> set_frame;
+		int len = dps_encode_parameters(params.data(), params.size(), cmd, sizeof(cmd));
+		if (len >= 0)
+			len = dps_encode_frame(cmd, len, set_frame.bytes.data(), static_cast<int>(set_frame.bytes.size()));
+		if (len < 0)
+			return fail(len);
+		set_frame.size = len;
+		return ack(transact(set_frame, CMD_SET_PARAMETERS));
+	}
+
+	Task<Result<dps_query_t>> query()
+	{
+		Result<int> len = co_await transact(frame::query, CMD_QUERY);
+		if (!len)
+			co_return Error{len.error()};
+		dps_query_t status;
+		int rc = dps_decode_query(response_.data(), *len, &status);
+		if (rc < 0)
+			co_return Error{rc};
+		co_return status;
+	}
+
+private:
+	AsyncDevice(Reactor &reactor, int fd) : reactor_(&reactor), fd_(fd) {}
+
+	static Task<Result<void>> fail(int rc) { co_return Error{rc}; }
+
+	static Task<Result<void>> ack(Task<Result<int>> task)
+	{
+		Result<int> len = co_await task;
+		if (!len)
+			co_return Error{len.error()};
+		co_return Result<void>();
+	}
+
+	template <std::size_t Len>
+	Task<Result<int>> transact(frame::Frame<Len> cmd_frame, std::uint8_t cmd)
+	{
+		if (busy_)
+			co_return Error{-EBUSY};
+		busy_ = true;
+		int rc = -ETIMEDOUT;
+		for (int retry = 0; retry <= MAX_RETRY; retry++)
+		{
+			if (::write(fd_, cmd_frame.bytes.data(), cmd_frame.size) != static_cast<ssize_t>(cmd_frame.size))
+			{
+				rc = -EIO;
+				break;
+			}
+			rc = co_await response(Clock::now() + timeout_);
+			if (rc > 0 && dps_response_ok(cmd, response_.data(), CMD_STATUS_SUCC) == 0)
+				break;
+			if (rc > 0)
+				rc = -EPROTO;
+		}
+		busy_ = false;
+		if (rc < 0)
+			co_return Error{rc};
+		co_return rc;
+	}
+
+	// Wait for the next complete response and decode it into response_
+	Task<int> response(Clock::time_point deadline)
+	{
+		for (;;)
+		{
+			int rc = next_frame();
+			// unsolicited frames are not the response, keep waiting
+			if (rc > 0 && dps_dispatch_event(this, response_.data(), rc) == 0)
+				continue;
+			if (rc != 0)
+				co_return rc;
+			Reactor::Wakeup ready = co_await reactor_->readable(fd_, deadline);
+			if (!ready)
+				co_return ready.error;
+			ssize_t len = ::read(fd_, rx_.data() + rx_len_, rx_.size() - rx_len_);
+			if (len < 0 && errno != EAGAIN)
+				co_return -errno;
+			if (len > 0)
+				rx_len_ += len;
+			if (rx_len_ == rx_.size())
+			{
+				rx_len_ = 0;
+				co_return -ENOBUFS;
+			}
+		}
+	}
+
+	int next_frame()
+	{
+		std::size_t sof = rx_len_;
+		for (std::size_t i = 0; i < rx_len_; i++)
+		{
+			if (rx_[i] == _SOF)
+			{
+				sof = i;
+			}
+			else if (rx_[i] == _EOF && sof < rx_len_)
+			{
+				int rc = dps_decode_frame(&rx_[sof + 1], static_cast<int>(i - sof - 1), response_.data(), static_cast<int>(response_.size()));
+				consume(i + 1);
+				return rc == 0 ? -EPROTO : rc;
+			}
+		}
+		// drop garbage in front of a partial frame
+		consume(sof);
+		return 0;
+	}
+
+	void consume(std::size_t len)
+	{
+		std::memmove(rx_.data(), rx_.data() + len, rx_len_ - len);
+		rx_len_ -= len;
+	}
+
+	Reactor *reactor_;
+	int fd_;
+	Clock::duration timeout_ = std::chrono::milliseconds(500);
+	bool busy_ = false;
+	std::array<std::uint8_t, INPUT_BUFFER_SIZE> rx_{};
+	std::size_t rx_len_ = 0;
+	std::array<std::uint8_t, INPUT_BUFFER_SIZE> response_{};
+};
+
+} // namespace opendps
+
+#endif //__LIB_OPENDPS_CORO_HPP__
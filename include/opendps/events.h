@@ -0,0 +1,75 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Unsolicited frames.
+ * The DPS may send frames on its own, ie. CMD_OCP_EVENT when the over
+ * current protection trips. Such frames have no CMD_RESPONSE bit. They are
+ * taken out of the response stream while waiting for a response, or by
+ * dps_poll_events() while idle, time stamped and handed to subscribers.
+ * The source tells devices apart when several share the subscribers: it
+ * is NULL for the library's own link and the AsyncDevice for coro.hpp.
+ * Events without a matching subscriber are kept in a queue for
+ * dps_next_event().
+ */
+
+#ifndef __LIB_OPENDPS_EVENTS_H__
+#define __LIB_OPENDPS_EVENTS_H__
+
+#include <time.h>
+#include "opendps/opendps.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define DPS_EVENT_QUEUE_SIZE 16
+#define DPS_EVENT_PAYLOAD_SIZE 32
+#define DPS_MAX_SUBSCRIBERS 8
+#define DPS_EVENT_ANY 0
+
+typedef struct event_t {
+	__uint8_t cmd;
+	int len;				// payload length
+	__uint8_t payload[DPS_EVENT_PAYLOAD_SIZE];
+	struct timespec timestamp;		// CLOCK_MONOTONIC time of arrival
+	const void *source;			// device the frame arrived on
+} dps_event_t;
+
+typedef void (*cb_event) (void *ctx, const dps_event_t *event);
+
+int dps_subscribe(__uint8_t cmd, cb_event cb, void *ctx);
+int dps_unsubscribe(cb_event cb, void *ctx);
+int dps_next_event(dps_event_t *event);
+int dps_poll_events();
+int dps_dropped_events();
+int dps_dispatch_event(const void *source, const __uint8_t *frame, int len);
+int dps_ocp_current(const dps_event_t *event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIB_OPENDPS_EVENTS_H__
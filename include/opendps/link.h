@@ -0,0 +1,90 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Link supervision for serial devices opened by dps_init().
+ * When the adapter goes away (EIO, ENXIO, hangup) the link is marked down
+ * instead of burning every retry on a dead fd. The device node, or a stable
+ * alias such as a /dev/serial/by-id link, is watched with inotify and
+ * reopened with the original baud rate as soon as it reappears, then pinged
+ * before the link is declared up again.
+ *
+ * Commands issued while the link is down either fail at once with
+ * -ENOTCONN (DPS_LINK_FAIL_FAST) or wait up to replay_timeout_ms for the
+ * device to come back and are then sent on the new link (DPS_LINK_REPLAY).
+ */
+
+#ifndef __LIB_OPENDPS_LINK_H__
+#define __LIB_OPENDPS_LINK_H__
+
+#include <time.h>
+#include "opendps/opendps.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define DPS_LINK_RETRY_MS 250			// reopen interval when no inotify event arrives
+
+typedef enum {
+	DPS_LINK_UP,
+	DPS_LINK_DOWN,
+} dps_link_state_t;
+
+typedef enum {
+	DPS_LINK_FAIL_FAST,
+	DPS_LINK_REPLAY,
+} dps_link_policy_t;
+
+typedef void (*cb_link_state) (void *ctx, dps_link_state_t state);
+
+typedef struct link_supervision_t {
+	dps_link_policy_t policy;
+	int replay_timeout_ms;
+	const char *watch_path;			// node to reopen, NULL for the dps_init() device
+	cb_link_state callback;			// may be NULL
+	void *ctx;
+} dps_link_supervision_t;
+
+typedef struct link_health_t {
+	dps_link_state_t state;
+	struct timespec last_change;		// CLOCK_MONOTONIC
+	int last_error;				// -errno
+	long disconnects;
+	long reconnects;
+	long rejected;				// commands failed while the link was down
+	long timeouts;
+	long crc_errors;
+} dps_link_health_t;
+
+int dps_supervise(const dps_link_supervision_t *supervision);
+int dps_link_recover();
+void dps_link_health(dps_link_health_t *health);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIB_OPENDPS_LINK_H__
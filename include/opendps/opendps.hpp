@@ -0,0 +1,286 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Header-only C++17 interface to libopendps.
+ * opendps::Device owns the link opened by dps_init() and closes it when it
+ * goes out of scope. Calls return opendps::Result, which holds either a
+ * value or a negative errno. Commands run through the transaction engine
+ * of the library (opendps/transact.h), so they share its retries, setpoint
+ * shadow and statistics with the C API. Commands with a fixed payload are
+ * sent as frames encoded at compile time, here and in opendps/coro.hpp.
+ *
+ * libopendps drives a single link per process, so only one Device can be
+ * open at a time.
+ */
+
+#ifndef __LIB_OPENDPS_HPP__
+#define __LIB_OPENDPS_HPP__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include "opendps/opendps.h"
+#include "opendps/transact.h"
+
+namespace opendps {
+
+struct Error {
+	int code;				// negative errno
+};
+
+template <typename T>
+class Result {
+public:
+	Result(T value) : data_(std::move(value)) {}
+	Result(Error error) : data_(error) {}
+
+	bool has_value() const { return data_.index() == 0; }
+	explicit operator bool() const { return has_value(); }
+	T &value() { return std::get<0>(data_); }
+	const T &value() const { return std::get<0>(data_); }
+	T &operator*() { return value(); }
+	const T &operator*() const { return value(); }
+	T *operator->() { return &value(); }
+	const T *operator->() const { return &value(); }
+	int error() const { return has_value() ? 0 : std::get<1>(data_).code; }
+
+private:
+	std::variant<T, Error> data_;
+};
+
+template <>
+class Result<void> {
+public:
+	Result() : error_(0) {}
+	Result(Error error) : error_(error.code) {}
+
+	bool has_value() const { return error_ == 0; }
+	explicit operator bool() const { return has_value(); }
+	int error() const { return error_; }
+
+private:
+	int error_;
+};
+
+inline Result<void> result(int rc)
+{
+	if (rc < 0)
+		return Error{rc};
+	return {};
+}
+
+// Non-owning view of bytes, ie. a firmware image or a raw response
+class ByteView {
+public:
+	constexpr ByteView() : data_(nullptr), size_(0) {}
+	constexpr ByteView(const std::uint8_t *data, std::size_t size) : data_(data), size_(size) {}
+
+	constexpr const std::uint8_t *data() const { return data_; }
+	constexpr std::size_t size() const { return size_; }
+	constexpr bool empty() const { return size_ == 0; }
+	constexpr const std::uint8_t *begin() const { return data_; }
+	constexpr const std::uint8_t *end() const { return data_ + size_; }
+	constexpr std::uint8_t operator[](std::size_t i) const { return data_[i]; }
+
+private:
+	const std::uint8_t *data_;
+	std::size_t size_;
+};
+
+// Views into the response buffer of the library, valid until the next command
+struct Version {
+	std::string_view bootloader;
+	std::string_view firmware;
+};
+
+namespace frame {
+
+// Escaped frame size in the worst case, see dps_encode_frame()
+constexpr std::size_t max_size(std::size_t len) { return 2 * (len + 2) + 2; }
+
+template <std::size_t Len>
+struct Frame {
+	std::array<std::uint8_t, max_size(Len)> bytes{};
+	std::size_t size = 0;
+
+	ByteView view() const { return ByteView(bytes.data(), size); }
+};
+
+constexpr std::uint16_t crc16_ccitt(const std::uint8_t *buf, std::size_t len)
+{
+	std::uint16_t crc = 0;
+	for (std::size_t i = 0; i < len; i++)
+	{
+		crc ^= static_cast<std::uint16_t>(buf[i] << 8);
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? static_cast<std::uint16_t>((crc << 1) ^ 0x1021) : static_cast<std::uint16_t>(crc << 1);
+	}
+	return crc;
+}
+
+template <std::size_t Len>
+constexpr void pack8(Frame<Len> &frame, std::uint8_t data)
+{
+	if (data == _SOF || data == _DLE || data == _EOF)
+	{
+		frame.bytes[frame.size++] = _DLE;
+		frame.bytes[frame.size++] = data ^ _XOR;
+	}
+	else
+	{
+		frame.bytes[frame.size++] = data;
+	}
+}
+
+template <std::size_t Len>
+constexpr Frame<Len> encode(const std::array<std::uint8_t, Len> &cmd)
+{
+	Frame<Len> frame;
+	std::uint16_t crc = crc16_ccitt(cmd.data(), Len);
+	frame.bytes[frame.size++] = _SOF;
+	for (std::size_t i = 0; i < Len; i++)
+		pack8(frame, cmd[i]);
+	pack8(frame, static_cast<std::uint8_t>(crc >> 8));
+	pack8(frame, static_cast<std::uint8_t>(crc & 0xff));
+	frame.bytes[frame.size++] = _EOF;
+	return frame;
+}
+
+inline constexpr auto ping = encode<1>({CMD_PING});
+inline constexpr auto query = encode<1>({CMD_QUERY});
+inline constexpr auto version = encode<1>({CMD_VERSION});
+inline constexpr auto power_on = encode<2>({CMD_ENABLE_OUTPUT, 1});
+inline constexpr auto power_off = encode<2>({CMD_ENABLE_OUTPUT, 0});
+inline constexpr auto lock = encode<2>({CMD_LOCK, 1});
+inline constexpr auto unlock = encode<2>({CMD_LOCK, 0});
+inline constexpr auto screen_main = encode<2>({CMD_CHANGE_SCREEN, SCREEN_MAIN});
+inline constexpr auto screen_settings = encode<2>({CMD_CHANGE_SCREEN, SCREEN_SETTINGS});
+
+} // namespace frame
+
+class Device {
+public:
+	static Result<Device> open(const char *serial_device, int baud_rate, bool verbose = false)
+	{
+		if (open_)
+			return Error{-EBUSY};
+		int rc = dps_init(serial_device, baud_rate, verbose);
+		if (rc < 0)
+		{
+			dps_close();
+			return Error{rc};
+		}
+		return Device();
+	}
+
+	Device(Device &&other) noexcept : owner_(std::exchange(other.owner_, false)) {}
+	Device &operator=(Device &&other) noexcept
+	{
+		if (this != &other)
+		{
+			close();
+			owner_ = std::exchange(other.owner_, false);
+		}
+		return *this;
+	}
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+	~Device() { close(); }
+
+	void close()
+	{
+		if (owner_)
+		{
+			dps_close();
+			open_ = false;
+			owner_ = false;
+		}
+	}
+
+	Result<void> ping() { return result(transact(frame::ping, CMD_PING)); }
+	Result<void> power(bool enable) { return result(transact(enable ? frame::power_on : frame::power_off, CMD_ENABLE_OUTPUT)); }
+	Result<void> lock(bool enable) { return result(transact(enable ? frame::lock : frame::unlock, CMD_LOCK)); }
+	Result<void> change_screen(std::uint8_t screen)
+	{
+		if (screen != SCREEN_MAIN && screen != SCREEN_SETTINGS)
+			return Error{-EINVAL};
+		return result(transact(screen == SCREEN_MAIN ? frame::screen_main : frame::screen_settings, CMD_CHANGE_SCREEN));
+	}
+
+	Result<void> brightness(int brightness) { return result(dps_brightness(brightness)); }
+	Result<void> voltage(int millivolt) { return result(dps_voltage(millivolt)); }
+	Result<void> current(int milliamp) { return result(dps_current(milliamp)); }
+	Result<void> set(std::initializer_list<dps_param_t> params)
+	{
+		return result(dps_set(params.begin(), static_cast<int>(params.size())));
+	}
+
+	Result<dps_query_t> query()
+	{
+		dps_query_t status;
+		int rc = transact(frame::query, CMD_QUERY, nullptr, &status);
+		if (rc < 0)
+			return Error{rc};
+		return status;
+	}
+
+	Result<Version> version()
+	{
+		dps_response_t response;
+		int rc = transact(frame::version, CMD_VERSION, &response);
+		if (rc < 0)
+			return Error{rc};
+		// two NUL terminated strings, the second one may lack its NUL
+		std::string_view data(reinterpret_cast<const char *>(response.data), static_cast<std::size_t>(response.len));
+		std::size_t nul = data.find('\0');
+		std::string_view firmware = data.substr(nul + 1);
+		return Version{data.substr(0, nul), firmware.substr(0, firmware.find('\0'))};
+	}
+
+	Result<void> upgrade(ByteView image, cb_upgrade_progress progress = nullptr)
+	{
+		return result(dps_upgrade_image(image.data(), static_cast<long>(image.size()), progress));
+	}
+
+private:
+	Device() : owner_(true) { open_ = true; }
+
+	template <std::size_t Len>
+	static int transact(const frame::Frame<Len> &encoded, std::uint8_t cmd, dps_response_t *response = nullptr, void *result = nullptr)
+	{
+		return dps_transact_frame(cmd, encoded.bytes.data(), static_cast<int>(encoded.size), response, result);
+	}
+
+	static inline bool open_ = false;
+	bool owner_;
+};
+
+} // namespace opendps
+
+#endif //__LIB_OPENDPS_HPP__
@@ -0,0 +1,104 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Live device state in POSIX shared memory.
+ * A segment holds one slot per device. Each publisher (one process per
+ * device, as libopendps drives one link per process) claims a slot by
+ * device name and is its only writer; claims are serialized by a lock
+ * word in the segment so two publishers of one device cannot both win.
+ * Every slot is a seqlock: the
+ * sequence number is odd while the state is being written, and a reader
+ * copies the state and retries if the sequence changed meanwhile. Readers
+ * never block the publisher and need no system call once the segment is
+ * mapped, so any number of dashboards or interlocks can poll it.
+ * A slot keeps its last state after the publisher exits; readers judge
+ * staleness by published_ms.
+ */
+
+#ifndef __LIB_OPENDPS_PUBLISH_H__
+#define __LIB_OPENDPS_PUBLISH_H__
+
+#include <sys/types.h>
+#include "opendps/opendps.h"
+#include "opendps/link.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define DPS_SHM_NAME "/opendps"
+#define DPS_SHM_SLOTS 16
+#define DPS_SHM_DEVICE_NAME 64
+#define DPS_SHM_READ_ATTEMPTS 64		// seqlock retries before a read gives up
+#define DPS_SHM_LOCK_ATTEMPTS 1000		// 1 ms apart, while another publisher claims a slot
+
+typedef struct shm_state_t {
+	char device[DPS_SHM_DEVICE_NAME];
+	__uint64_t updates;			// number of publications
+	__int64_t sampled_us;			// CLOCK_MONOTONIC time of the query
+	__int64_t published_ms;			// CLOCK_REALTIME time of publication
+	int query_rc;				// result of the last query, status is from the last good one
+	dps_query_t status;
+	dps_link_health_t health;
+} dps_shm_state_t;
+
+typedef struct shm_slot_t {
+	__uint32_t seq;				// odd while the publisher writes
+	pid_t owner;				// publisher, 0 for a free slot
+	dps_shm_state_t state;
+} dps_shm_slot_t;
+
+typedef struct shm_segment_t {
+	__uint32_t magic;
+	__uint32_t size;
+	pid_t lock;				// publisher claiming a slot, 0 when free
+	dps_shm_slot_t slots[DPS_SHM_SLOTS];
+} dps_shm_segment_t;
+
+typedef struct publisher_t {
+	dps_shm_segment_t *segment;
+	dps_shm_slot_t *slot;
+	dps_shm_state_t state;			// staged copy of the slot
+} dps_publisher_t;
+
+typedef struct reader_t {
+	const dps_shm_segment_t *segment;
+} dps_reader_t;
+
+int dps_publisher_open(dps_publisher_t *publisher, const char *name, const char *device);
+void dps_publish(dps_publisher_t *publisher, int query_rc, const dps_query_t *status);
+void dps_publisher_close(dps_publisher_t *publisher);
+
+int dps_reader_open(dps_reader_t *reader, const char *name);
+int dps_reader_find(const dps_reader_t *reader, const char *device);
+int dps_reader_snapshot(const dps_reader_t *reader, int slot, dps_shm_state_t *state);
+void dps_reader_close(dps_reader_t *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIB_OPENDPS_PUBLISH_H__
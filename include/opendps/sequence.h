@@ -0,0 +1,66 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Timed setpoint sequences.
+ * Every step is encoded to a wire frame by dps_sequence_prepare(), so
+ * dps_sequence_run() only has to sleep until the absolute deadline of a
+ * step and write its frame. The actual issue time of every step is
+ * recorded next to its planned offset.
+ */
+
+#ifndef __LIB_OPENDPS_SEQUENCE_H__
+#define __LIB_OPENDPS_SEQUENCE_H__
+
+#include "opendps/opendps.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define DPS_SEQ_MAX_PARAMS 4
+#define DPS_SEQ_CMD_SIZE 128
+#define DPS_SEQ_FRAME_SIZE DPS_FRAME_SIZE(DPS_SEQ_CMD_SIZE)
+
+typedef struct seq_step_t {
+	long offset_us;				// planned issue time, relative to start of sequence
+	int num_params;
+	dps_param_t params[DPS_SEQ_MAX_PARAMS];
+	// filled in by dps_sequence_prepare()
+	__uint8_t frame[DPS_SEQ_FRAME_SIZE];
+	int frame_len;
+	// filled in by dps_sequence_run()
+	long issued_us;				// actual issue time, relative to start of sequence
+	int rc;
+} dps_seq_step_t;
+
+int dps_sequence_prepare(dps_seq_step_t *steps, int count);
+int dps_sequence_run(dps_seq_step_t *steps, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIB_OPENDPS_SEQUENCE_H__
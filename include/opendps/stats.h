@@ -0,0 +1,114 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Output statistics.
+ * dps_stats_t keeps cumulative and rolling window statistics of v_out and
+ * i_out, updated in O(1) per sample: min/max through monotonic queues,
+ * mean/RMS through integer running sums, and charge/energy by trapezoidal
+ * integration over the sample timestamps. Results can be taken at any
+ * time between two samples. dps_stats_reduce() computes the same figures
+ * over stored columns in one pass.
+ */
+
+#ifndef __LIB_OPENDPS_STATS_H__
+#define __LIB_OPENDPS_STATS_H__
+
+#include "opendps/opendps.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define DPS_STATS_WINDOW 256
+
+typedef struct stats_result_t {
+	long count;
+	double duration_s;
+	__uint16_t v_min;			// mV
+	__uint16_t v_max;
+	double v_mean;
+	double v_rms;
+	__uint16_t i_min;			// mA
+	__uint16_t i_max;
+	double i_mean;
+	double i_rms;
+	double p_mean;				// mW
+	double charge_mah;
+	double energy_wh;
+} dps_stats_result_t;
+
+typedef struct minmax_queue_t {
+	long seq[DPS_STATS_WINDOW];
+	int head;
+	int len;
+} dps_minmax_queue_t;
+
+typedef struct stats_sums_t {
+	long count;
+	__uint64_t v_sum;
+	__uint64_t v_sum_sq;
+	__uint64_t i_sum;
+	__uint64_t i_sum_sq;
+	__uint64_t p_sum;			// mV * mA
+	double charge;				// mA * us
+	double energy;				// mV * mA * us
+} dps_stats_sums_t;
+
+typedef struct stats_t {
+	int window;				// window length in samples, at most DPS_STATS_WINDOW
+	long seq;				// number of samples added
+	__int64_t first_us;
+	__int64_t last_us;
+	// cumulative
+	dps_stats_sums_t total;
+	__uint16_t v_min;
+	__uint16_t v_max;
+	__uint16_t i_min;
+	__uint16_t i_max;
+	// rolling window
+	dps_stats_sums_t recent;
+	__int64_t timestamp_us[DPS_STATS_WINDOW];
+	__uint16_t v_out[DPS_STATS_WINDOW];
+	__uint16_t i_out[DPS_STATS_WINDOW];
+	double charge[DPS_STATS_WINDOW];	// integral since the previous sample
+	double energy[DPS_STATS_WINDOW];
+	dps_minmax_queue_t v_min_queue;
+	dps_minmax_queue_t v_max_queue;
+	dps_minmax_queue_t i_min_queue;
+	dps_minmax_queue_t i_max_queue;
+} dps_stats_t;
+
+void dps_stats_init(dps_stats_t *stats, int window);
+void dps_stats_add(dps_stats_t *stats, __int64_t timestamp_us, const dps_query_t *sample);
+void dps_stats_total(const dps_stats_t *stats, dps_stats_result_t *result);
+void dps_stats_window(const dps_stats_t *stats, dps_stats_result_t *result);
+int dps_stats_reduce(const __uint16_t *v_out, const __uint16_t *i_out, const __int64_t *timestamp_us, int count, dps_stats_result_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIB_OPENDPS_STATS_H__
@@ -0,0 +1,66 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Append-only telemetry store.
+ * Samples are appended to a memory mapped file made of fixed size segments.
+ * Within a segment every column is delta encoded against the previous
+ * sample and written as a zigzag varint; the first sample of a segment is
+ * encoded against zero so each segment decodes on its own. The segment
+ * headers hold the first and last timestamp and act as a sparse time
+ * index, so reading a time range only decodes the segments it overlaps.
+ */
+
+#ifndef __LIB_OPENDPS_STORE_H__
+#define __LIB_OPENDPS_STORE_H__
+
+#include "opendps/opendps.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define DPS_STORE_SEGMENT_SIZE 65536
+#define DPS_STORE_COLUMNS 7
+
+typedef struct store_t {
+	int fd;
+	int segments;
+	__uint8_t *tail;			// mapped last segment, writable stores only
+	__int64_t last[DPS_STORE_COLUMNS];	// last appended sample, timestamp first, for delta encoding
+} dps_store_t;
+
+typedef int (*cb_store_sample) (void *ctx, __int64_t timestamp_ms, const dps_query_t *sample);
+
+int dps_store_open(dps_store_t *store, const char *file_name, bool writable);
+int dps_store_append(dps_store_t *store, __int64_t timestamp_ms, const dps_query_t *sample);
+int dps_store_read(dps_store_t *store, __int64_t from_ms, __int64_t to_ms, cb_store_sample cb, void *ctx);
+void dps_store_close(dps_store_t *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIB_OPENDPS_STORE_H__
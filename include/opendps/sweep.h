@@ -0,0 +1,69 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Setpoint sweeps (IV curves).
+ * The parameter is stepped from start to stop. After each step the output
+ * is allowed to settle and is then measured a number of times. The last
+ * query of a point is sent back-to-back with the setpoint of the next
+ * point, so the next transmission overlaps the current measurement.
+ * Averaged results are written to caller provided columns.
+ */
+
+#ifndef __LIB_OPENDPS_SWEEP_H__
+#define __LIB_OPENDPS_SWEEP_H__
+
+#include "opendps/opendps.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct sweep_t {
+	const char *param;			// parameter to sweep, ie. "u" or "i"
+	int start;
+	int stop;
+	int step;				// always positive, direction is given by start and stop
+	long settle_us;				// wait after each setpoint before measuring
+	int samples;				// queries averaged per point
+} dps_sweep_t;
+
+typedef struct sweep_result_t {
+	int capacity;				// number of points each column can hold
+	int count;				// number of points measured
+	int *setpoint;
+	double *v_out;				// mV
+	double *i_out;				// mA
+	long *timestamp_us;			// first sample of the point, relative to start of sweep
+} dps_sweep_result_t;
+
+int dps_sweep_points(const dps_sweep_t *sweep);
+int dps_sweep(const dps_sweep_t *sweep, dps_sweep_result_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIB_OPENDPS_SWEEP_H__
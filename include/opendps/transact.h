@@ -0,0 +1,91 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Raw command transactions.
+ * dps_transact() sends any command byte with a payload and waits for the
+ * matching response. How a command is retried and checked comes from a
+ * command table: an idempotent command is resent up to MAX_RETRY times
+ * when its response is lost or garbled, the others are sent once. A
+ * response is successful when it carries the expected status byte and,
+ * if the command has a parser, the parser accepts it. Commands missing
+ * from the table are sent once and expect CMD_STATUS_SUCC; newer firmware
+ * commands can be described with dps_register_command(). Statistics are
+ * kept per command, for unknown ones up to DPS_UNLISTED_COMMANDS of them.
+ *
+ * dps_transact_frame() does the same for a frame encoded by the caller,
+ * ie. at compile time.
+ *
+ * The response view points into a buffer owned by the library and stays
+ * valid until the next command. A response with an unexpected status is
+ * still returned in the view, with -EREMOTEIO.
+ */
+
+#ifndef __LIB_OPENDPS_TRANSACT_H__
+#define __LIB_OPENDPS_TRANSACT_H__
+
+#include "opendps/opendps.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define DPS_COMMANDS_MAX 32			// built in and registered commands
+#define DPS_UNLISTED_COMMANDS 16		// unknown commands with statistics of their own
+
+typedef struct response_t {
+	__uint8_t cmd;				// command answered, without CMD_RESPONSE
+	__uint8_t status;
+	const __uint8_t *data;			// response data after the status byte
+	int len;
+} dps_response_t;
+
+// result is NULL when the caller only wants the response checked
+typedef int (*cb_parse_response) (const dps_response_t *response, void *result);
+
+typedef struct command_t {
+	__uint8_t cmd;
+	bool idempotent;			// safe to resend when the response is lost
+	__uint8_t status;			// status byte of a successful response
+	cb_parse_response parse;		// may be NULL
+} dps_command_t;
+
+typedef struct command_stats_t {
+	unsigned long transactions;
+	unsigned long retries;
+	unsigned long timeouts;
+	unsigned long failures;
+} dps_command_stats_t;
+
+int dps_transact(__uint8_t cmd, const void *payload, int len, dps_response_t *response, void *result);
+int dps_transact_frame(__uint8_t cmd, const __uint8_t *frame, int len, dps_response_t *response, void *result);
+int dps_register_command(const dps_command_t *command);
+int dps_command_stats(__uint8_t cmd, dps_command_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIB_OPENDPS_TRANSACT_H__
@@ -0,0 +1,80 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Link transports.
+ * The library sends complete frames through a transport and reads back
+ * whatever the transport delivers. Stream transports (serial, sockets)
+ * may split or join frames and are resynchronised on _SOF/_EOF. Datagram
+ * transports (UDP) deliver exactly one frame per receive, so nothing is
+ * carried over between receives.
+ */
+
+#ifndef __LIB_OPENDPS_TRANSPORT_H__
+#define __LIB_OPENDPS_TRANSPORT_H__
+
+#include "opendps/opendps.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define DPS_UDP_PORT 5005
+#define DPS_LOOPBACK_BUFFER_SIZE 256
+
+typedef struct transport_t {
+	const char *name;
+	bool datagram;
+	// returns bytes written or a negative error
+	int (*send) (void *link, const __uint8_t *frame, int len);
+	// returns bytes read, 0 if nothing arrived within ~100ms, or a negative error
+	int (*recv) (void *link, __uint8_t *buf, int size);
+	void (*close) (void *link);
+} dps_transport_t;
+
+// Loopback responder, gets a decoded command and returns the length of the decoded response
+typedef int (*cb_loopback) (void *ctx, const __uint8_t *cmd, int len, __uint8_t *response, int size);
+
+typedef struct loopback_t {
+	cb_loopback responder;			// NULL to echo frames back unchanged
+	void *ctx;
+	__uint8_t buf[DPS_LOOPBACK_BUFFER_SIZE];
+	int len;
+} dps_loopback_t;
+
+extern const dps_transport_t dps_fd_transport;		// link is a file descriptor cast to void *
+extern const dps_transport_t dps_seqpacket_transport;	// link is a connected SOCK_SEQPACKET socket cast to void *
+extern const dps_transport_t dps_udp_transport;		// link is a connected socket cast to void *
+extern const dps_transport_t dps_loopback_transport;	// link is a dps_loopback_t
+
+int dps_init_transport(const dps_transport_t *transport, void *link, bool pverbose);
+int dps_init_udp(const char *host, int port, bool pverbose);	// port 1..65535, usually DPS_UDP_PORT
+int dps_init_loopback(dps_loopback_t *loopback, bool pverbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIB_OPENDPS_TRANSPORT_H__
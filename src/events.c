@@ -0,0 +1,132 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "opendps/events.h"
+
+typedef struct subscriber_t {
+	__uint8_t cmd;
+	cb_event cb;
+	void *ctx;
+} subscriber_t;
+
+static subscriber_t subscribers[DPS_MAX_SUBSCRIBERS];
+static dps_event_t queue[DPS_EVENT_QUEUE_SIZE];
+static int queue_head = 0;
+static int queue_len = 0;
+static int dropped = 0;
+
+int dps_subscribe(__uint8_t cmd, cb_event cb, void *ctx)
+{
+	for (int i = 0; i < DPS_MAX_SUBSCRIBERS; i++)
+	{
+		if (subscribers[i].cb == NULL)
+		{
+			subscribers[i].cmd = cmd;
+			subscribers[i].cb = cb;
+			subscribers[i].ctx = ctx;
+			return 0;
+		}
+	}
+	return -ENOSPC;
+}
+
+int dps_unsubscribe(cb_event cb, void *ctx)
+{
+	int rc = -ENOENT;
+	for (int i = 0; i < DPS_MAX_SUBSCRIBERS; i++)
+	{
+		if (subscribers[i].cb == cb && subscribers[i].ctx == ctx)
+		{
+			subscribers[i].cb = NULL;
+			rc = 0;
+		}
+	}
+	return rc;
+}
+
+int dps_next_event(dps_event_t *event)
+{
+	if (queue_len == 0)
+		return -EAGAIN;
+	*event = queue[queue_head];
+	queue_head = (queue_head + 1) % DPS_EVENT_QUEUE_SIZE;
+	queue_len--;
+	return 0;
+}
+
+int dps_dropped_events()
+{
+	return dropped;
+}
+
+/*
+ * Returns 0 if the decoded frame was an unsolicited event and has been
+ * delivered, -ENOMSG if it is a response.
+ */
+int dps_dispatch_event(const void *source, const __uint8_t *frame, int len)
+{
+	dps_event_t event;
+	bool delivered = false;
+
+	if (len < 1 || (frame[0] & CMD_RESPONSE))
+		return -ENOMSG;
+
+	event.cmd = frame[0];
+	event.len = len - 1 < DPS_EVENT_PAYLOAD_SIZE ? len - 1 : DPS_EVENT_PAYLOAD_SIZE;
+	memcpy(event.payload, frame + 1, event.len);
+	clock_gettime(CLOCK_MONOTONIC, &event.timestamp);
+	event.source = source;
+
+	for (int i = 0; i < DPS_MAX_SUBSCRIBERS; i++)
+	{
+		subscriber_t *sub = &subscribers[i];
+		if (sub->cb != NULL && (sub->cmd == DPS_EVENT_ANY || sub->cmd == event.cmd))
+		{
+			sub->cb(sub->ctx, &event);
+			delivered = true;
+		}
+	}
+
+	if (!delivered)
+	{
+		// drop the oldest event when the queue is full
+		if (queue_len == DPS_EVENT_QUEUE_SIZE)
+		{
+			queue_head = (queue_head + 1) % DPS_EVENT_QUEUE_SIZE;
+			queue_len--;
+			dropped++;
+		}
+		queue[(queue_head + queue_len) % DPS_EVENT_QUEUE_SIZE] = event;
+		queue_len++;
+	}
+	return 0;
+}
+
+// Current in mA at which the output was cut, or -EINVAL if not an OCP event
+int dps_ocp_current(const dps_event_t *event)
+{
+	if (event->cmd != CMD_OCP_EVENT || event->len < 2)
+		return -EINVAL;
+	return event->payload[0] << 8 | event->payload[1];
+}
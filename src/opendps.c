@@ -22,18 +22,180 @@
  * THE SOFTWARE.
  */
 
+#include <libgen.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
 #include "opendps/opendps.h"
+#include "opendps/transport.h"
+#include "opendps/events.h"
+#include "opendps/link.h"
+#include "opendps/transact.h"
+#include "diag.h"
 
 static bool verbose = false;
-static int fd = -1;
+static const dps_transport_t *transport = NULL;
+static void *link_handle = NULL;
 
-int set_serial_attribs(int speed)
+#ifndef OPENDPS_EMBEDDED
+static void print_diagnostic(void *ctx, const dps_diag_t *diag)
+{
+	printf("%s", diag->message);
+	if (diag->subject != NULL)
+		printf(" %s", diag->subject);
+	if (diag->kind == DPS_DIAG_FRAME)
+	{
+		printf(" %d bytes [", diag->len);
+		for (int i = 0; i < diag->len; i++)
+			printf(" %2.2x", diag->data[i]);
+		printf(" ]");
+	}
+	else if (diag->kind == DPS_DIAG_INFO)
+	{
+		printf(": %ld", diag->value);
+	}
+	if (diag->kind != DPS_DIAG_INFO && diag->value < 0)
+		printf(": %s", strerror(-diag->value));
+	printf("\n");
+}
+
+static cb_diagnostic diagnostic_cb = print_diagnostic;
+#else
+static cb_diagnostic diagnostic_cb = NULL;
+#endif
+static void *diagnostic_ctx = NULL;
+
+void dps_set_diagnostics(cb_diagnostic callback, void *ctx)
+{
+	diagnostic_cb = callback;
+	diagnostic_ctx = ctx;
+}
+
+void diagnostic(dps_diag_kind_t kind, const char *message, const char *subject, long value)
+{
+	dps_diag_t diag = { .kind = kind, .message = message, .subject = subject, .value = value };
+	if (diagnostic_cb != NULL)
+		diagnostic_cb(diagnostic_ctx, &diag);
+}
+
+void diagnostic_frame(const char *message, const __uint8_t *data, int len, long value)
+{
+	dps_diag_t diag = { .kind = DPS_DIAG_FRAME, .message = message, .value = value, .data = data, .len = len };
+	if (diagnostic_cb != NULL)
+		diagnostic_cb(diagnostic_ctx, &diag);
+}
+
+/*
+ * Bytes read from the link are kept in rx_buf until a complete frame has
+ * been consumed, so a response that arrives back-to-back with the next one
+ * (pipelined commands) is not lost.
+ */
+static __uint8_t rx_buf[INPUT_BUFFER_SIZE];
+static int rx_len = 0;
+
+/*
+ * Last setpoints acknowledged by the DPS on this link. A write of the value
+ * already in place is answered locally. The shadow is dropped when the link
+ * is (re)initialised, on link errors, when raw frames bypass it, and per
+ * field when a write fails or a query disagrees.
+ */
+enum {
+	SHADOW_VOLTAGE,
+	SHADOW_CURRENT,
+	SHADOW_OUTPUT,
+	SHADOW_LOCK,
+	SHADOW_BRIGHTNESS,
+	SHADOW_SCREEN,
+	SHADOW_FIELDS
+};
+
+static struct {
+	bool valid[SHADOW_FIELDS];
+	int value[SHADOW_FIELDS];
+} shadow;
+static bool shadow_force = false;
+static long suppressed_writes = 0;
+
+void dps_shadow_invalidate()
+{
+	memset(&shadow, 0, sizeof(shadow));
+}
+
+void dps_shadow_force(bool force)
+{
+	shadow_force = force;
+}
+
+long dps_suppressed_writes()
+{
+	return suppressed_writes;
+}
+
+static bool shadow_matches(int field, int value)
+{
+	return !shadow_force && shadow.valid[field] && shadow.value[field] == value;
+}
+
+static bool shadow_skip(int field, int value)
+{
+	if (!shadow_matches(field, value))
+		return false;
+	suppressed_writes++;
+	return true;
+}
+
+static int shadow_update(int field, int value, int rc)
+{
+	shadow.valid[field] = rc == 0;
+	shadow.value[field] = value;
+	return rc;
+}
+
+/*
+ * Supervision of a tty opened by dps_init(), see opendps/link.h.
+ */
+#define LINK_PATH_SIZE 128
+
+static char link_path[LINK_PATH_SIZE];
+static int link_baud;
+static bool supervised = false;
+static bool recovering = false;
+static dps_link_supervision_t supervision;
+static dps_link_health_t health;
+static int watch_fd = -1;
+static int watch_wd = -1;
+
+static bool link_down()
+{
+	return supervised && health.state == DPS_LINK_DOWN && !recovering;
+}
+
+static bool link_lost(int rc)
+{
+	return rc == -EIO || rc == -ENXIO || rc == -ENODEV || rc == -EPIPE || rc == -EBADF;
+}
+
+static void link_drop(int rc);
+static int link_recover(int wait_ms);
+
+static int shadow_param(const char *name)
+{
+	if (strcmp(name, "u") == 0)
+		return SHADOW_VOLTAGE;
+	if (strcmp(name, "i") == 0)
+		return SHADOW_CURRENT;
+	return -1;
+}
+
+int set_serial_attribs(int fd, int speed)
 {
 	struct termios tty;
 
 	if (tcgetattr(fd, &tty) < 0)
 	{
-		printf("Error from tcgetattr: %s\n", strerror(errno));
+		diagnostic(DPS_DIAG_ERROR, "Error from tcgetattr", NULL, -errno);
 		return -1;
 	}
 
@@ -60,7 +222,7 @@ int set_serial_attribs(int speed)
 
 	if (tcsetattr(fd, TCSANOW, &tty) != 0)
 	{
-		printf("Error from tcsetattr: %s\n", strerror(errno));
+		diagnostic(DPS_DIAG_ERROR, "Error from tcsetattr", NULL, -errno);
 		return -1;
 	}
 	return 0;
@@ -105,43 +267,122 @@ int get_baud(int baudrate)
 	}
 }
 
-int dps_init(const char *serial_device, int baud_rate, bool pverbose)
+int dps_open_tty(const char *serial_device, int baud_rate)
 {
+	int tty_fd = open(serial_device, O_RDWR | O_NOCTTY | O_SYNC);
+	if (tty_fd < 0)
+	{
+		int rc = -errno;
+		diagnostic(DPS_DIAG_ERROR, "Error opening", serial_device, rc);
+		return rc;
+	}
+
+	if (set_serial_attribs(tty_fd, get_baud(baud_rate)) < 0)
+	{
+		close(tty_fd);
+		return -EIO;
+	}
+	return tty_fd;
+}
+
+int dps_init_transport(const dps_transport_t *ptransport, void *link, bool pverbose)
+{
+	dps_close();
 	verbose = pverbose;
+	transport = ptransport;
+	link_handle = link;
+	return 0;
+}
 
-	fd = open(serial_device, O_RDWR | O_NOCTTY | O_SYNC);
+int dps_init(const char *serial_device, int baud_rate, bool pverbose)
+{
+	int fd = dps_open_tty(serial_device, baud_rate);
 	if (fd < 0)
-	{
-		printf("Error opening %s: %s\n", serial_device, strerror(errno));
 		return fd;
-	}
+	int rc = dps_init_transport(&dps_fd_transport, (void *)(intptr_t) fd, pverbose);
+	// remembered for reopening a supervised link
+	if (strlen(serial_device) < sizeof(link_path))
+		strcpy(link_path, serial_device);
+	link_baud = baud_rate;
+	return rc;
+}
 
-	return set_serial_attribs(get_baud(baud_rate));
+/*
+ * Use an already connected link, ie. a socket to a dpsctl daemon. Reads
+ * on the link are expected to time out (SO_RCVTIMEO) like the tty does.
+ * On a SOCK_SEQPACKET socket an empty message ends the wait for a response.
+ */
+int dps_init_fd(int link_fd, bool pverbose)
+{
+	int type;
+	socklen_t len = sizeof(type);
+	if (getsockopt(link_fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_SEQPACKET)
+		return dps_init_transport(&dps_seqpacket_transport, (void *)(intptr_t) link_fd, pverbose);
+	return dps_init_transport(&dps_fd_transport, (void *)(intptr_t) link_fd, pverbose);
 }
 
-unsigned short crc16_ccitt(const void *buf, int len)
+void dps_close()
+{
+	if (transport != NULL && !(supervised && health.state == DPS_LINK_DOWN))
+		transport->close(link_handle);
+	if (watch_fd >= 0)
+		close(watch_fd);
+	watch_fd = -1;
+	watch_wd = -1;
+	supervised = false;
+	link_path[0] = '\0';
+	memset(&health, 0, sizeof(health));
+	transport = NULL;
+	link_handle = NULL;
+	rx_len = 0;
+	dps_shadow_invalidate();
+}
+
+static const unsigned short crc16tab[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0};
+
+static unsigned short crc16_update(unsigned short crc, const void *buf, int len)
 {
 	register int counter;
-	register unsigned short crc = 0;
 	for (counter = 0; counter < len; counter++)
 		crc = (crc << 8) ^ crc16tab[((crc >> 8) ^ *(char *)buf++) & 0x00FF];
 	return crc;
 }
 
-unsigned short calc_crc_file(char *filename)
+unsigned short crc16_ccitt(const void *buf, int len)
 {
-	__uint8_t buffer[65536];
-	unsigned short result = 0;
-	FILE *file = fopen(filename, "r");
-	if (file != NULL) {
-		size_t read = fread(&buffer, sizeof(__uint8_t), sizeof(buffer), file);
-		if (read > 0)
-			result = crc16_ccitt(&buffer, read);
-		if (verbose)
-			printf("File: %s, size: %d, CRC: %2.2x %2.2x\n", filename, read, (result >> 8), (result &  0xff));
-		fclose(file);
-	}
-	return result;
+	return crc16_update(0, buf, len);
 }
 
 void pack8(__uint8_t data, void *buf, int *idx)
@@ -184,135 +425,201 @@ char* unpack_cstr(void *buf, int *idx)
         return buf_start;
 }
 
-int send_cmd(int fd, const void *cmd, int len)
+/*
+ * Frame a command given as a header followed by a payload, so bulk data
+ * such as firmware chunks need not be copied behind the command byte.
+ */
+static int encode_frame(const void *cmd, int cmd_len, const void *payload, int len, __uint8_t *frame, int frame_size)
 {
-	__uint8_t output[OUTPUT_BUFFER_SIZE + len];
 	int idx = 0;
+	// worst case every byte of payload and crc needs escaping
+	if (frame_size < DPS_FRAME_SIZE(cmd_len + len))
+		return -ENOBUFS;
 	// calc CRC16
-	unsigned short crc = crc16_ccitt(cmd, len);
+	unsigned short crc = crc16_update(crc16_ccitt(cmd, cmd_len), payload, len);
 	// Build request
-	output[idx++] = _SOF;
+	frame[idx++] = _SOF;
+	for (int i = 0; i < cmd_len; i++)
+	{
+		pack8(*(char *)(cmd + i), frame, &idx);
+	}
 	for (int i = 0; i < len; i++)
 	{
-		pack8(*(char *)(cmd + i), &output, &idx);
+		pack8(*(char *)(payload + i), frame, &idx);
 	}
-	pack8((crc >> 8), &output, &idx);
-	pack8((crc & 0xff), &output, &idx);
-	output[idx++] = _EOF;
-	int cmd_size = idx;
+	pack8((crc >> 8), frame, &idx);
+	pack8((crc & 0xff), frame, &idx);
+	frame[idx++] = _EOF;
+	return idx;
+}
+
+int dps_encode_frame(const void *cmd, int len, __uint8_t *frame, int frame_size)
+{
+	return encode_frame(cmd, len, NULL, 0, frame, frame_size);
+}
+
+// decimal without the printf family, returns the length or -ENOBUFS
+static int pack_decimal(int value, char *buf, int size)
+{
+	char digits[12];
+	int len = 0;
+	unsigned int magnitude = value < 0 ? -(unsigned int) value : (unsigned int) value;
+	do {
+		digits[len++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude > 0);
+	if (value < 0)
+		digits[len++] = '-';
+	if (len > size)
+		return -ENOBUFS;
+	for (int i = 0; i < len; i++)
+		buf[i] = digits[len - 1 - i];
+	return len;
+}
+
+int dps_encode_parameters(const dps_param_t *params, int count, __uint8_t *cmd, int cmd_size)
+{
+	int idx = 0;
+	if (count <= 0 || cmd_size < 1)
+		return -EINVAL;
+	cmd[idx++] = CMD_SET_PARAMETERS;
+	for (int i = 0; i < count; i++)
+	{
+		int name_len = strlen(params[i].name) + 1;
+		if (idx + name_len >= cmd_size)
+			return -ENOBUFS;
+		memcpy(cmd + idx, params[i].name, name_len);
+		idx += name_len;
+		int size = pack_decimal(params[i].value, (char *)cmd + idx, cmd_size - idx - 1);
+		if (size < 0)
+			return size;
+		idx += size;
+		cmd[idx++] = '\0';
+	}
+	return idx;
+}
+
+static int send_frame(const __uint8_t *frame, int len)
+{
 	if (verbose)
+		diagnostic_frame("TX", frame, len, 0);
+	if (transport == NULL)
+		return -ENOTCONN;
+	if (link_down() && link_recover(supervision.policy == DPS_LINK_REPLAY ? supervision.replay_timeout_ms : 0) < 0)
+		return -ENOTCONN;
+	int rc = transport->send(link_handle, frame, len);
+	if (rc < 0)
 	{
-		printf("TX %d bytes [", idx);
-		for (__uint8_t *p = output; idx-- > 0; p++)
-			printf(" %2.2x", (*p & 0xff));
-		printf(" ]\n");
+		dps_shadow_invalidate();
+		if (link_lost(rc))
+		{
+			link_drop(rc);
+			// send on the reopened link instead
+			if (link_down() && supervision.policy == DPS_LINK_REPLAY && link_recover(supervision.replay_timeout_ms) == 0)
+				rc = transport->send(link_handle, frame, len);
+		}
 	}
-	int rc = write(fd, output, cmd_size);
-	tcdrain(fd);
 	return rc;
 }
 
-//FIXME: please clean this shit up
-int get_response(int fd, void *output_buffer, int buf_size)
+// commands that cannot change a shadowed setpoint
+static bool shadow_unaffected(__uint8_t cmd)
 {
-	__uint8_t input_buf[INPUT_BUFFER_SIZE];
-	int buf_idx = 0;
-	int len = 0;
+	return cmd == CMD_PING || cmd == CMD_QUERY || cmd == CMD_VERSION || cmd == CMD_WIFI_STATUS ||
+		cmd == CMD_LIST_FUNCTIONS || cmd == CMD_LIST_PARAMETERS || cmd == CMD_CAL_REPORT;
+}
+
+// caller built frames may change any setpoint, the command byte follows _SOF unescaped
+int dps_send_frame(const __uint8_t *frame, int len)
+{
+	if (len < 2 || !shadow_unaffected(frame[1]))
+		dps_shadow_invalidate();
+	return send_frame(frame, len);
+}
+
+// sized for the largest command, a firmware chunk
+static __uint8_t tx_frame[DPS_FRAME_SIZE(UPGRADE_CHUNK_SIZE + 1)];
+
+static int send_cmd_payload(const void *cmd, int cmd_len, const void *payload, int len)
+{
+	int size = encode_frame(cmd, cmd_len, payload, len, tx_frame, sizeof(tx_frame));
+	if (size < 0)
+		return size;
+	return send_frame(tx_frame, size);
+}
+
+int send_cmd(const void *cmd, int len)
+{
+	return send_cmd_payload(cmd, len, NULL, 0);
+}
+
+static void rx_consume(int len)
+{
+	memmove(rx_buf, rx_buf + len, rx_len - len);
+	rx_len -= len;
+}
+
+/*
+ * Unescape and check a frame, given as the bytes between _SOF and _EOF.
+ * Returns the length of the response without CRC.
+ */
+int dps_decode_frame(const __uint8_t *frame, int len, void *output_buffer, int buf_size)
+{
+	__uint8_t *output = output_buffer;
 	int idx = 0;
-	__uint8_t input;
-	bool crc_ok = false;
 	bool dle = false;
-	bool eof = false;
-	int max_fetches = 10;
-	memset(input_buf, 0x00, sizeof(input_buf)); // clear buffer
-	do
+	bool crc_ok = false;
+	for (int i = 0; i < len; i++)
 	{
-		len = read(fd, &input_buf[buf_idx], sizeof(input_buf) - buf_idx);
-		if (len > 0)
+		if (frame[i] == _DLE)
 		{
-			if (verbose)
-				printf("Buffer: ");
-			for (int i=buf_idx; i < (buf_idx + len); i++) {
-				if (verbose)
-					printf(" %2.2x", input_buf[i]);
-				if (input_buf[i] == _EOF) {
-					eof = true;
-					break;
-				}
-			}
-			if (verbose)
-				printf("\n");
-			buf_idx += len;
-		} else if (len == 0)
-			max_fetches--;
-		if (verbose)
-			printf("Read input: %d, total: %d, fetches: %d, EOF: %d\n", len, buf_idx, max_fetches, eof);
-	} while (!eof && max_fetches > 0);
-
-	if (buf_idx > buf_size)
+			dle = true;
+			continue;
+		}
+		if (idx >= buf_size)
+			return -ENOBUFS;
+		output[idx++] = dle ? frame[i] ^ _XOR : frame[i];
+		dle = false;
+	}
+	if (idx > 2)
 	{
-		return -ENOBUFS;
+		// get crc16, calc crc16 and compare
+		unsigned short crc16 = (output[idx - 2] << 8) | output[idx - 1];
+		crc_ok = crc16 == crc16_ccitt(output, idx - 2);
 	}
-	else if (buf_idx > 0)
+	return (crc_ok ? (idx - 2) : -EPROTO);
+}
+
+/*
+ * Decode the first complete frame in rx_buf. Returns 0 when rx_buf holds
+ * no complete frame yet.
+ */
+static int next_frame(void *output_buffer, int buf_size)
+{
+	int sof = -1;
+	for (int i = 0; i < rx_len; i++)
 	{
-		unsigned char *p;
-		unsigned char *cmd_begin = NULL;
-		int cmd_len = 0;
-		if (verbose)
-			printf("RX %d bytes [", buf_idx);
-		for (p = input_buf; buf_idx-- > 0; p++)
+		if (rx_buf[i] == _SOF)
 		{
+			sof = i;
+		}
+		else if (rx_buf[i] == _EOF && sof >= 0)
+		{
+			int rc = dps_decode_frame(&rx_buf[sof + 1], i - sof - 1, output_buffer, buf_size);
 			if (verbose)
-				printf(" %2.2x", *p);
-			if (*p == _SOF)
-			{
-				cmd_begin = p + 1;
-			}
-			else if (cmd_begin != NULL)
-			{
-				if (*p == _EOF)
-				{
-					if ((p - 2) > cmd_begin)
-					{
-						// get crc16
-						unsigned short crc16 = (*(p - 2) << 8) | (*(p - 1) & 0xff);
-						cmd_len = (p - 2) - cmd_begin;
-						// calc crc16 and compare
-						crc_ok = crc16 == crc16_ccitt(cmd_begin, cmd_len);
-					}
-				}
-				else if (*p == _DLE)
-				{
-					dle = true;
-				}
-				else
-				{
-					if (dle)
-					{
-						*(char *)(output_buffer + idx++) = *p ^ _XOR;
-						dle = false;
-					}
-					else
-					{
-						*(char *)(output_buffer + idx++) = *p;
-					}
-				}
-			}
+				diagnostic_frame("RX", &rx_buf[sof], i - sof + 1, rc > 0 ? 0 : -EPROTO);
+			if (rc <= 0)
+				health.crc_errors++;
+			rx_consume(i + 1);
+			return rc == 0 ? -EPROTO : rc;
 		}
-		if (verbose)
-			printf(" ] %s\n\n", (crc_ok ? "CRC OK" : "CRC FAILED"));
-		return (crc_ok ? (idx - 2) : -EPROTO);
-	}
-	else if (len < 0)
-	{
-		printf("Error from read: %d: %s\n", len, strerror(errno));
-		return errno;
-	}
-	else
-	{ /* len == 0 timeout */
-		printf("Error from read: %d: %s\n", len, "timeout");
-		return -ETIMEDOUT;
 	}
+	// drop garbage in front of a partial frame
+	if (sof < 0)
+		rx_len = 0;
+	else if (sof > 0)
+		rx_consume(sof);
+	return 0;
 }
 
 int response_ok(__uint8_t cmd, const void *buf, __uint8_t succ)
@@ -326,310 +633,775 @@ int response_ok(__uint8_t cmd, const void *buf, __uint8_t succ)
 		return -EIO;
 }
 
-int dps_ping()
+int get_response(void *output_buffer, int buf_size)
 {
-	__uint8_t cmd_buffer[] = {CMD_PING};
-	__uint8_t response_buffer[32];
-	int retry = MAX_RETRY;
+	int max_fetches = 10;
+	int len;
 	int rc;
-	do {
-		rc = send_cmd(fd, cmd_buffer, sizeof(cmd_buffer));
-		if (rc < 0)
-			return rc;
-
-		rc = get_response(fd, &response_buffer, sizeof(response_buffer));
-		if (rc > 0 && response_ok(CMD_PING, &response_buffer, CMD_STATUS_SUCC) == 0)
-			return 0;
-		rc = -EPROTO;
-		retry--;
-	} while(retry >= 0);
+	if (transport == NULL || link_down())
+		return -ENOTCONN;
+	for (;;)
+	{
+		rc = next_frame(output_buffer, buf_size);
+		// unsolicited frames are not the response, keep waiting
+		if (rc > 0 && dps_dispatch_event(NULL, output_buffer, rc) == 0)
+		{
+			// over current protection switched the output off
+			if (*(__uint8_t *) output_buffer == CMD_OCP_EVENT)
+				shadow.valid[SHADOW_OUTPUT] = false;
+			continue;
+		}
+		// output switched by the DPS itself, ie. by a button, seen by any query
+		if (rc >= 14 && response_ok(CMD_QUERY, output_buffer, CMD_STATUS_SUCC) == 0 &&
+		    shadow.valid[SHADOW_OUTPUT] && shadow.value[SHADOW_OUTPUT] != (((__uint8_t *) output_buffer)[8] == 1))
+			shadow.valid[SHADOW_OUTPUT] = false;
+		if (rc != 0)
+			break;
+		// a datagram carries one frame, never resync across datagrams
+		if (transport->datagram)
+			rx_len = 0;
+		if (rx_len == sizeof(rx_buf))
+		{
+			rx_len = 0;
+			return -ENOBUFS;
+		}
+		len = transport->recv(link_handle, &rx_buf[rx_len], sizeof(rx_buf) - rx_len);
+		if (len > 0)
+		{
+			if (verbose)
+				diagnostic_frame("Buffer", &rx_buf[rx_len], len, 0);
+			rx_len += len;
+		}
+		else if (len < 0)
+		{
+			diagnostic(DPS_DIAG_ERROR, "Error from", transport->name, len);
+			dps_shadow_invalidate();
+			if (len == -ETIMEDOUT)
+				health.timeouts++;
+			if (link_lost(len))
+				link_drop(len);
+			return len;
+		}
+		else if (--max_fetches == 0)
+		{
+			if (rx_len > 0)
+				return -EPROTO;
+			diagnostic(DPS_DIAG_ERROR, "Error from", transport->name, -ETIMEDOUT);
+			dps_shadow_invalidate();
+			health.timeouts++;
+			return -ETIMEDOUT;
+		}
+		if (verbose)
+			diagnostic(DPS_DIAG_INFO, "Read input", NULL, len);
+	}
+	if (transport->datagram)
+		rx_len = 0;
 	return rc;
 }
 
-int dps_lock(bool enable)
+/*
+ * Deliver unsolicited frames that arrived while no command was in flight.
+ * Waits at most one read timeout of the transport. Responses found here
+ * are stale and dropped. Returns the number of events delivered.
+ */
+int dps_poll_events()
 {
-	__uint8_t cmd_buffer[] = {CMD_LOCK, enable ? 1 : 0};
-	__uint8_t response_buffer[32];
-	int retry = MAX_RETRY;
+	__uint8_t frame[INPUT_BUFFER_SIZE];
+	int events = 0;
 	int rc;
-	do {
-		rc = send_cmd(fd, cmd_buffer, sizeof(cmd_buffer));
+	if (transport == NULL)
+		return -ENOTCONN;
+	if (link_down() && link_recover(0) < 0)
+		return -ENOTCONN;
+	if (transport->datagram)
+		rx_len = 0;
+	if (rx_len < (int) sizeof(rx_buf))
+	{
+		rc = transport->recv(link_handle, &rx_buf[rx_len], sizeof(rx_buf) - rx_len);
+		if (link_lost(rc))
+			link_drop(rc);
 		if (rc < 0)
 			return rc;
+		rx_len += rc;
+	}
+	while ((rc = next_frame(frame, sizeof(frame))) != 0)
+	{
+		if (rc > 0 && dps_dispatch_event(NULL, frame, rc) == 0)
+			events++;
+	}
+	return events;
+}
 
-		rc = get_response(fd, &response_buffer, sizeof(response_buffer));
-		if (rc > 0 && response_ok(CMD_LOCK, &response_buffer, CMD_STATUS_SUCC) == 0)
-			return 0;
-		rc = -EPROTO;
-		retry--;
-	} while(retry >= 0);
-	return rc;
+static void link_set_state(dps_link_state_t state)
+{
+	health.state = state;
+	clock_gettime(CLOCK_MONOTONIC, &health.last_change);
+	if (supervision.callback != NULL)
+		supervision.callback(supervision.ctx, state);
 }
 
-int dps_brightness(int brightness)
+static void link_drop(int rc)
 {
-	__uint8_t cmd_buffer[] = {CMD_SET_BRIGHTNESS, brightness};
+	health.last_error = rc;
+	if (!supervised || health.state == DPS_LINK_DOWN)
+		return;
+	transport->close(link_handle);
+	link_handle = (void *)(intptr_t) -1;
+	rx_len = 0;
+	dps_shadow_invalidate();
+	health.disconnects++;
+	diagnostic(DPS_DIAG_ERROR, "Lost link to", link_path, rc);
+	link_set_state(DPS_LINK_DOWN);
+}
+
+// watch the directory of the node, it may not exist while the adapter is gone
+static void link_watch()
+{
+	char dir[LINK_PATH_SIZE];
+	if (watch_fd < 0)
+		watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch_fd < 0 || watch_wd >= 0)
+		return;
+	strcpy(dir, link_path);
+	watch_wd = inotify_add_watch(watch_fd, dirname(dir), IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+}
+
+static void link_wait(int timeout_ms)
+{
+	char events[1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { .fd = watch_fd, .events = POLLIN };
+	link_watch();
+	if (poll(&pfd, watch_fd >= 0 ? 1 : 0, timeout_ms) <= 0)
+		return;
+	int len = read(watch_fd, events, sizeof(events));
+	for (int i = 0; i < len; )
+	{
+		const struct inotify_event *event = (const struct inotify_event *)(events + i);
+		// the watched directory was removed, add it again once it is back
+		if (event->mask & IN_IGNORED)
+			watch_wd = -1;
+		i += sizeof(struct inotify_event) + event->len;
+	}
+}
+
+static int link_reopen()
+{
+	// not through tx_frame, it may hold the command waiting for the link
+	__uint8_t cmd_buffer[] = {CMD_PING};
+	__uint8_t frame[8];
 	__uint8_t response_buffer[32];
-	int retry = MAX_RETRY;
-	int rc;
-	do {
-		rc = send_cmd(fd, cmd_buffer, sizeof(cmd_buffer));
-		if (rc < 0)
-			return rc;
+	if (access(link_path, F_OK) != 0)
+		return -ENODEV;
+	int fd = open(link_path, O_RDWR | O_NOCTTY | O_SYNC);
+	if (fd < 0)
+		return -errno;
+	if (set_serial_attribs(fd, get_baud(link_baud)) < 0)
+	{
+		close(fd);
+		return -EIO;
+	}
+	// the adapter may be back before the DPS answers
+	link_handle = (void *)(intptr_t) fd;
+	recovering = true;
+	int rc = send_frame(frame, dps_encode_frame(cmd_buffer, sizeof(cmd_buffer), frame, sizeof(frame)));
+	if (rc >= 0)
+		rc = get_response(&response_buffer, sizeof(response_buffer));
+	recovering = false;
+	if (rc <= 0 || response_ok(CMD_PING, &response_buffer, CMD_STATUS_SUCC) != 0)
+	{
+		close(fd);
+		link_handle = (void *)(intptr_t) -1;
+		rx_len = 0;
+		return rc < 0 ? rc : -EPROTO;
+	}
+	health.reconnects++;
+	link_set_state(DPS_LINK_UP);
+	return 0;
+}
 
-		rc = get_response(fd, &response_buffer, sizeof(response_buffer));
-		if (rc > 0 && response_ok(CMD_SET_BRIGHTNESS, &response_buffer, CMD_STATUS_SUCC) == 0)
+static int link_recover(int wait_ms)
+{
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;)
+	{
+		if (link_reopen() == 0)
 			return 0;
-		rc = -EPROTO;
-		retry--;
-	} while(retry >= 0);
-	return rc;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int remaining = wait_ms - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+		if (remaining <= 0)
+			break;
+		link_wait(remaining < DPS_LINK_RETRY_MS ? remaining : DPS_LINK_RETRY_MS);
+	}
+	health.rejected++;
+	return -ENOTCONN;
 }
 
-int dps_power(bool enable)
+int dps_supervise(const dps_link_supervision_t *psupervision)
 {
-	__uint8_t cmd_buffer[] = {CMD_ENABLE_OUTPUT, enable ? 1 : 0};
-	__uint8_t response_buffer[32];
-	int retry = MAX_RETRY;
+	if (psupervision == NULL)
+	{
+		supervised = false;
+		return 0;
+	}
+	if (transport != &dps_fd_transport || link_path[0] == '\0')
+		return -ENOTSUP;
+	if (psupervision->watch_path != NULL)
+	{
+		if (strlen(psupervision->watch_path) >= sizeof(link_path))
+			return -ENAMETOOLONG;
+		strcpy(link_path, psupervision->watch_path);
+	}
+	supervision = *psupervision;
+	supervision.watch_path = link_path;
+	supervised = true;
+	link_watch();
+	return 0;
+}
+
+/*
+ * Try to bring a lost link back without sending a command, ie. from an
+ * idle loop. Returns 0 when the link is up.
+ */
+int dps_link_recover()
+{
+	if (!link_down())
+		return transport != NULL ? 0 : -ENOTCONN;
+	link_wait(0);
+	return link_reopen();
+}
+
+void dps_link_health(dps_link_health_t *phealth)
+{
+	*phealth = health;
+}
+
+int dps_get_response(void *response, int size)
+{
+	return get_response(response, size);
+}
+
+int dps_response_ok(__uint8_t cmd, const void *response, __uint8_t status)
+{
+	return response_ok(cmd, response, status);
+}
+
+/*
+ * Command table, see opendps/transact.h. Filled on first use since the
+ * CMD_ constants are not constant expressions in C.
+ */
+struct command_entry {
+	dps_command_t command;
+	dps_command_stats_t stats;
+};
+
+static struct command_entry commands[DPS_COMMANDS_MAX];
+static int command_count = 0;
+// commands missing from the table, kept apart so they never use up its slots
+static struct command_entry unlisted[DPS_UNLISTED_COMMANDS];
+static int unlisted_count = 0;
+// shared by the unlisted commands that no longer fit
+static struct command_entry unlisted_overflow;
+
+// responses are returned as views into this buffer
+static __uint8_t response_buffer[INPUT_BUFFER_SIZE];
+
+static int parse_query(const dps_response_t *response, void *result);
+static int parse_version(const dps_response_t *response, void *result);
+
+static void command_set(struct command_entry *entry, __uint8_t cmd, bool idempotent, __uint8_t status, cb_parse_response parse)
+{
+	dps_command_t command = { .cmd = cmd, .idempotent = idempotent, .status = status, .parse = parse };
+	entry->command = command;
+}
+
+static void command_add(__uint8_t cmd, bool idempotent, __uint8_t status, cb_parse_response parse)
+{
+	command_set(&commands[command_count++], cmd, idempotent, status, parse);
+}
+
+static void commands_init()
+{
+	command_add(CMD_PING, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_QUERY, true, CMD_STATUS_SUCC, parse_query);
+	command_add(CMD_WIFI_STATUS, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_LOCK, true, CMD_STATUS_SUCC, NULL);
+	// a resent chunk would be flashed twice
+	command_add(CMD_UPGRADE_START, false, UPGRADE_CONTINUE, NULL);
+	command_add(CMD_UPGRADE_DATA, false, UPGRADE_CONTINUE, NULL);
+	command_add(CMD_SET_FUNCTION, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_ENABLE_OUTPUT, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_LIST_FUNCTIONS, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_SET_PARAMETERS, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_LIST_PARAMETERS, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_TEMPERATURE_REPORT, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_VERSION, true, CMD_STATUS_SUCC, parse_version);
+	command_add(CMD_CAL_REPORT, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_SET_CALIBRATION, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_CLEAR_CALIBRATION, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_CHANGE_SCREEN, true, CMD_STATUS_SUCC, NULL);
+	command_add(CMD_SET_BRIGHTNESS, true, CMD_STATUS_SUCC, NULL);
+}
+
+static struct command_entry *find_command(__uint8_t cmd)
+{
+	if (command_count == 0)
+		commands_init();
+	for (int i = 0; i < command_count; i++)
+	{
+		if (commands[i].command.cmd == cmd)
+			return &commands[i];
+	}
+	return NULL;
+}
+
+static struct command_entry *find_unlisted(__uint8_t cmd)
+{
+	for (int i = 0; i < unlisted_count; i++)
+	{
+		if (unlisted[i].command.cmd == cmd)
+			return &unlisted[i];
+	}
+	return NULL;
+}
+
+// unknown commands get an entry of their own for the statistics
+static struct command_entry *lookup_command(__uint8_t cmd)
+{
+	struct command_entry *entry = find_command(cmd);
+	if (entry == NULL)
+		entry = find_unlisted(cmd);
+	if (entry != NULL)
+		return entry;
+	entry = unlisted_count < DPS_UNLISTED_COMMANDS ? &unlisted[unlisted_count++] : &unlisted_overflow;
+	command_set(entry, cmd, false, CMD_STATUS_SUCC, NULL);
+	return entry;
+}
+
+int dps_register_command(const dps_command_t *command)
+{
+	struct command_entry *entry = find_command(command->cmd);
+	struct command_entry *previous = find_unlisted(command->cmd);
+	if (entry == NULL)
+	{
+		if (command_count == DPS_COMMANDS_MAX)
+			return -ENOSPC;
+		entry = &commands[command_count++];
+		memset(&entry->stats, 0, sizeof(entry->stats));
+	}
+	// carry over what was counted while the command was unknown
+	if (previous != NULL)
+	{
+		entry->stats = previous->stats;
+		*previous = unlisted[--unlisted_count];
+	}
+	entry->command = *command;
+	return 0;
+}
+
+int dps_command_stats(__uint8_t cmd, dps_command_stats_t *stats)
+{
+	struct command_entry *entry = find_command(cmd);
+	if (entry == NULL)
+		entry = find_unlisted(cmd);
+	if (entry == NULL)
+		return -ENOENT;
+	*stats = entry->stats;
+	return 0;
+}
+
+static int check_response(const dps_command_t *command, int len, dps_response_t *response, void *result)
+{
+	// a late response to an earlier command, or garbage
+	if (len < 2 || response_buffer[0] != (command->cmd | CMD_RESPONSE))
+		return -EPROTO;
+	response->cmd = command->cmd;
+	response->status = response_buffer[1];
+	response->data = &response_buffer[2];
+	response->len = len - 2;
+	if (response->status != command->status)
+		return -EREMOTEIO;
+	return command->parse != NULL ? command->parse(response, result) : 0;
+}
+
+/*
+ * The one send, receive and retry loop behind every command. Send errors
+ * are returned at once, the link supervision has already had its go at
+ * them. A lost, garbled or unparsable response is retried for idempotent
+ * commands and reported as -EPROTO. Statistics go to entry, the response
+ * is checked against command.
+ */
+static int exchange(struct command_entry *entry, const dps_command_t *command, const __uint8_t *frame, int size,
+		    dps_response_t *response, void *result)
+{
+	dps_response_t view;
+	int attempts = command->idempotent ? MAX_RETRY + 1 : 1;
 	int rc;
-	do {
-		rc = send_cmd(fd, cmd_buffer, sizeof(cmd_buffer));
+	if (response == NULL)
+		response = &view;
+	entry->stats.transactions++;
+	for (int attempt = 0; attempt < attempts; attempt++)
+	{
+		if (attempt > 0)
+			entry->stats.retries++;
+		rc = send_frame(frame, size);
 		if (rc < 0)
-			return rc;
+			break;
+		rc = get_response(response_buffer, sizeof(response_buffer));
+		if (rc == -ETIMEDOUT)
+			entry->stats.timeouts++;
+		if (rc > 0)
+			rc = check_response(command, rc, response, result);
+		else
+			rc = -EPROTO;
+		if (rc == 0 || rc == -EREMOTEIO)
+			break;
+	}
+	if (rc < 0)
+		entry->stats.failures++;
+	return rc < 0 ? rc : 0;
+}
+
+static int transact_command(struct command_entry *entry, const dps_command_t *command, const void *payload, int len,
+			    dps_response_t *response, void *result)
+{
+	int size = encode_frame(&command->cmd, 1, payload, len, tx_frame, sizeof(tx_frame));
+	if (size < 0)
+		return size;
+	return exchange(entry, command, tx_frame, size, response, result);
+}
+
+static int transact(__uint8_t cmd, const void *payload, int len, dps_response_t *response, void *result)
+{
+	struct command_entry *entry = lookup_command(cmd);
+	return transact_command(entry, &entry->command, payload, len, response, result);
+}
+
+// for a step of a command that answers with a status other than the usual one
+static int transact_expect(__uint8_t cmd, __uint8_t status, const void *payload, int len, dps_response_t *response, void *result)
+{
+	struct command_entry *entry = lookup_command(cmd);
+	dps_command_t command = entry->command;
+	command.status = status;
+	return transact_command(entry, &command, payload, len, response, result);
+}
+
+// raw commands may change any setpoint
+int dps_transact(__uint8_t cmd, const void *payload, int len, dps_response_t *response, void *result)
+{
+	if (!shadow_unaffected(cmd))
+		dps_shadow_invalidate();
+	return transact(cmd, payload, len, response, result);
+}
 
-		rc = get_response(fd, &response_buffer, sizeof(response_buffer));
-		if (rc > 0 && response_ok(CMD_ENABLE_OUTPUT, &response_buffer, CMD_STATUS_SUCC) == 0)
+// setpoint written by a command with a single byte payload, -1 for others
+static int shadow_command(__uint8_t cmd)
+{
+	if (cmd == CMD_ENABLE_OUTPUT)
+		return SHADOW_OUTPUT;
+	if (cmd == CMD_LOCK)
+		return SHADOW_LOCK;
+	if (cmd == CMD_SET_BRIGHTNESS)
+		return SHADOW_BRIGHTNESS;
+	if (cmd == CMD_CHANGE_SCREEN)
+		return SHADOW_SCREEN;
+	return -1;
+}
+
+/*
+ * Pre-encoded commands, the command byte follows _SOF unescaped. A frame
+ * writing a single setpoint goes through the shadow like the dps_* call
+ * it stands for, and a suppressed write leaves response untouched.
+ */
+int dps_transact_frame(__uint8_t cmd, const __uint8_t *frame, int len, dps_response_t *response, void *result)
+{
+	__uint8_t decoded[4];			// command, setpoint and CRC
+	int field = shadow_command(cmd);
+	if (len < 4 || frame[0] != _SOF || frame[1] != cmd)
+		return -EINVAL;
+	struct command_entry *entry = lookup_command(cmd);
+	if (field >= 0 && dps_decode_frame(frame + 1, len - 2, decoded, sizeof(decoded)) == 2)
+	{
+		if (shadow_skip(field, decoded[1]))
 			return 0;
-		rc = -EPROTO;
-		retry--;
-	} while(retry >= 0);
-	return rc;
+		return shadow_update(field, decoded[1], exchange(entry, &entry->command, frame, len, response, result));
+	}
+	if (!shadow_unaffected(cmd))
+		dps_shadow_invalidate();
+	return exchange(entry, &entry->command, frame, len, response, result);
+}
+
+int dps_ping()
+{
+	return transact(CMD_PING, NULL, 0, NULL, NULL);
+}
+
+int dps_lock(bool enable)
+{
+	__uint8_t payload = enable ? 1 : 0;
+	if (shadow_skip(SHADOW_LOCK, enable))
+		return 0;
+	return shadow_update(SHADOW_LOCK, enable, transact(CMD_LOCK, &payload, 1, NULL, NULL));
+}
+
+int dps_brightness(int brightness)
+{
+	__uint8_t payload = brightness;
+	if (shadow_skip(SHADOW_BRIGHTNESS, brightness))
+		return 0;
+	return shadow_update(SHADOW_BRIGHTNESS, brightness, transact(CMD_SET_BRIGHTNESS, &payload, 1, NULL, NULL));
+}
+
+int dps_power(bool enable)
+{
+	__uint8_t payload = enable ? 1 : 0;
+	if (shadow_skip(SHADOW_OUTPUT, enable))
+		return 0;
+	return shadow_update(SHADOW_OUTPUT, enable, transact(CMD_ENABLE_OUTPUT, &payload, 1, NULL, NULL));
 }
 
 int dps_voltage(int millivol)
 {
-	__uint8_t cmd_buffer[18];
-	__uint8_t response_buffer[32];
-	int retry = MAX_RETRY;
-	int rc;
-	do {
-		int size = sprintf((char *)cmd_buffer, "%cu%c%d%c", CMD_SET_PARAMETERS, '\0', millivol, '\0');
-		if (size < 0)
-			return -EIO;
-		rc = send_cmd(fd, cmd_buffer, size);
-		if (rc < 0)
-			return rc;
-	
-		rc = get_response(fd, &response_buffer, sizeof(response_buffer));
-		if (rc > 0 && response_ok(CMD_SET_PARAMETERS, &response_buffer, CMD_STATUS_SUCC) == 0)
-			return 0;
-		rc = -EPROTO;
-		retry--;
-	} while (retry >= 0);
-	return rc;
+	dps_param_t param = { "u", millivol };
+	return dps_set(&param, 1);
 }
 
 int dps_current(int milliamp)
 {
-	__uint8_t cmd_buffer[18];
-	__uint8_t response_buffer[32];
-	int retry = MAX_RETRY;
-	int rc;
-	do {
-		int size = sprintf((char *)cmd_buffer, "%ci%c%d%c", CMD_SET_PARAMETERS, '\0', milliamp, '\0');
-		if (size < 0)
-			return -EIO;
-		rc = send_cmd(fd, cmd_buffer, size);
-		if (rc < 0)
-			return rc;
+	dps_param_t param = { "i", milliamp };
+	return dps_set(&param, 1);
+}
 
-		rc = get_response(fd, &response_buffer, sizeof(response_buffer));
-		if (rc > 0 && response_ok(CMD_SET_PARAMETERS, &response_buffer, CMD_STATUS_SUCC) == 0)
-			return 0;
-		rc = -EPROTO;
-		retry--;
-	} while(retry >= 0);
+int dps_set(const dps_param_t *params, int count)
+{
+	__uint8_t cmd_buffer[64];
+	int unchanged = 0;
+	for (int i = 0; i < count; i++)
+	{
+		int field = shadow_param(params[i].name);
+		if (field >= 0 && shadow_matches(field, params[i].value))
+			unchanged++;
+	}
+	if (count > 0 && unchanged == count)
+	{
+		suppressed_writes++;
+		return 0;
+	}
+	int size = dps_encode_parameters(params, count, cmd_buffer, sizeof(cmd_buffer));
+	if (size < 0)
+		return size;
+	int rc = transact(CMD_SET_PARAMETERS, cmd_buffer + 1, size - 1, NULL, NULL);
+	for (int i = 0; i < count; i++)
+	{
+		int field = shadow_param(params[i].name);
+		if (field >= 0)
+			shadow_update(field, params[i].value, rc);
+	}
 	return rc;
 }
 
-int dps_query(dps_query_t *result) {
-        __uint8_t cmd_buffer[] = { CMD_QUERY };
-        __uint8_t response_buffer[128];
-	int retry = MAX_RETRY;
-	int rc;
-	do {
-        	rc = send_cmd(fd, cmd_buffer, sizeof(cmd_buffer));
-        	if (rc < 0)
-                	return rc;
-
-        	rc = get_response(fd, &response_buffer, sizeof(response_buffer));
-        	if (rc > 0) {
-                	if (response_ok(CMD_QUERY, &response_buffer, CMD_STATUS_SUCC) != 0) return -EIO;
-                	int idx = 2;
-                	result->v_in = unpack16(response_buffer, &idx);
-                	result->v_out = unpack16(response_buffer, &idx);
-                	result->i_out = unpack16(response_buffer, &idx);
-                	result->output_enabled = (response_buffer[idx++] == 1);
-                	__uint16_t temp1 = unpack16(response_buffer, &idx);
-                	if (temp1 != 0xffff && temp1 & 0x8000) {
-                        	temp1 -= 0x10000;
-                        	result->temp1 = (double) temp1 / 10;
-                	} else {
-                        	result->temp1 = -DBL_MAX;
-                	}
-                	__uint16_t temp2 = unpack16(response_buffer, &idx);
-                	if (temp2 != 0xffff && temp2 & 0x8000) {
-                        	temp2 -= 0x10000;
-                        	result->temp2 = (double) temp2 / 10;
-                	} else {
-                        	result->temp2 = -DBL_MAX;
-                	}
-                	result->temp_shutdown = (response_buffer[idx++] == 1);
-                //while (idx < rc) {
-                //      char *key = unpack_cstr(response_buffer, &idx);
-                //      char *val = unpack_cstr(response_buffer, &idx);
-                //}
-                	return 0;
-        	}
-		rc = -EPROTO;
-		retry--;
-	} while (retry >= 0);
-        return rc;
+static double unpack_temperature(__uint8_t *buf, int *idx)
+{
+	__uint16_t temp = unpack16(buf, idx);
+	if (temp != 0xffff && temp & 0x8000) {
+		temp -= 0x10000;
+		return (double) temp / 10;
+	}
+	return -DBL_MAX;
+}
+
+static int parse_query(const dps_response_t *response, void *result)
+{
+	dps_query_t *query = result;
+	__uint8_t *data = (__uint8_t *) response->data;
+	int idx = 0;
+	if (response->len < 12)
+		return -EPROTO;
+	if (query == NULL)
+		return 0;
+	query->v_in = unpack16(data, &idx);
+	query->v_out = unpack16(data, &idx);
+	query->i_out = unpack16(data, &idx);
+	query->output_enabled = (data[idx++] == 1);
+	query->temp1 = unpack_temperature(data, &idx);
+	query->temp2 = unpack_temperature(data, &idx);
+	query->temp_shutdown = (data[idx++] == 1);
+	//while (idx < len) {
+	//      char *key = unpack_cstr(response_buffer, &idx);
+	//      char *val = unpack_cstr(response_buffer, &idx);
+	//}
+	return 0;
+}
+
+int dps_decode_query(const void *response, int len, dps_query_t *result)
+{
+	const __uint8_t *buf = response;
+	dps_response_t view = { .cmd = CMD_QUERY, .data = buf + 2, .len = len - 2 };
+	if (len < 14 || response_ok(CMD_QUERY, response, CMD_STATUS_SUCC) != 0)
+		return -EIO;
+	return parse_query(&view, result);
+}
+
+int dps_query(dps_query_t *result)
+{
+	return transact(CMD_QUERY, NULL, 0, NULL, result);
 }
 
 int dps_change_screen(__uint8_t screen)
 {
-        __uint8_t cmd_buffer[] = {CMD_CHANGE_SCREEN, screen};
-        __uint8_t response_buffer[32];
-	int retry = MAX_RETRY;
-	int rc;
-	do {
-        	rc = send_cmd(fd, cmd_buffer, sizeof(cmd_buffer));
-        	if (rc < 0)
-                	return rc;
+	if (shadow_skip(SHADOW_SCREEN, screen))
+		return 0;
+	return shadow_update(SHADOW_SCREEN, screen, transact(CMD_CHANGE_SCREEN, &screen, 1, NULL, NULL));
+}
 
-        	rc = get_response(fd, &response_buffer, sizeof(response_buffer));
-        	if (rc > 0 && response_ok(CMD_CHANGE_SCREEN, &response_buffer, CMD_STATUS_SUCC) == 0)
-			return 0;
-		rc = -EPROTO;
-		retry--;
-	} while(retry >= 0);
-	return rc;
+/*
+ * The bootloader version is a nul terminated string, the firmware version
+ * follows and may lack its terminator.
+ */
+static int parse_version(const dps_response_t *response, void *result)
+{
+	dps_version_t *version = result;
+	const char *bootloader_ver = (const char *) response->data;
+	int bootloader_len = strnlen(bootloader_ver, response->len);
+	if (response->len < 11 || bootloader_len == response->len)
+		return -EPROTO;
+	const char *firmware_ver = bootloader_ver + bootloader_len + 1;
+	int firmware_len = strnlen(firmware_ver, response->len - bootloader_len - 1);
+	if (version == NULL)
+		return 0;
+#ifdef OPENDPS_EMBEDDED
+	static char bootloader_buf[INPUT_BUFFER_SIZE];
+	static char firmware_buf[INPUT_BUFFER_SIZE];
+	memcpy(bootloader_buf, bootloader_ver, bootloader_len + 1);
+	memcpy(firmware_buf, firmware_ver, firmware_len);
+	firmware_buf[firmware_len] = '\0';
+	version->bootloader_ver = bootloader_buf;
+	version->firmware_ver = firmware_buf;
+#else
+	version->bootloader_ver = strdup(bootloader_ver);
+	version->firmware_ver = strndup(firmware_ver, firmware_len);
+#endif
+	return 0;
 }
 
 int dps_version(dps_version_t *version)
 {
-        __uint8_t cmd_buffer[] = {CMD_VERSION};
-        __uint8_t response_buffer[128];
-	int retry = MAX_RETRY;
-	int res;
-	do {
-        	res = send_cmd(fd, cmd_buffer, sizeof(cmd_buffer));
-        	if (res < 0)
-                	return res;
-
-        	int size = get_response(fd, &response_buffer, sizeof(response_buffer));
-        	if (size >= 13 && response_ok(CMD_VERSION, &response_buffer, CMD_STATUS_SUCC) == 0)
-        	{
-                	int idx = 2;
-                	version->bootloader_ver = strdup(unpack_cstr(response_buffer, &idx));
-                	version->firmware_ver = strdup(unpack_cstr(response_buffer, &idx));
-                	return 0;
-        	}
-		res = -EPROTO;
-		retry--;
-	} while(retry >= 0);
-	return res;
+	return transact(CMD_VERSION, NULL, 0, NULL, version);
 }
 
-int dps_upgrade(char *fw_file_name, cb_upgrade_progress progress)
+void dps_free_version(dps_version_t *version)
 {
-        __uint8_t cmd_buffer[5] = { CMD_UPGRADE_START, 0, 0, 0, 0 };
-        __uint8_t response_buffer[32];
-        __uint16_t chunk_size = 1024;
-        // Check if file is a valid firmware
+#ifndef OPENDPS_EMBEDDED
+	free(version->bootloader_ver);
+	free(version->firmware_ver);
+#endif
+	version->bootloader_ver = NULL;
+	version->firmware_ver = NULL;
+}
+
+int dps_upgrade_image(const __uint8_t *image, long size, cb_upgrade_progress progress)
+{
+        __uint8_t payload[4];
+        __uint16_t chunk_size = UPGRADE_CHUNK_SIZE;
+	dps_response_t response;
+        // Check if image is a valid firmware
 
         // Calc crc
-        unsigned short crc = calc_crc_file(fw_file_name);
-
-        int idx = 1;
-        pack16(chunk_size, &cmd_buffer, &idx);
-	pack8((crc >> 8), &cmd_buffer, &idx);
-	pack8((crc & 0xff), &cmd_buffer, &idx);
-        int rc = send_cmd(fd, cmd_buffer, sizeof(cmd_buffer));
-        if (rc < 0)
-                return rc;
-        rc = get_response(fd, &response_buffer, sizeof(response_buffer));
-	idx = 2;
-        if (rc > 0 && response_ok(CMD_UPGRADE_START, &response_buffer, UPGRADE_CONTINUE) == 0) {
-                __uint16_t dps_chunk_size = unpack16(response_buffer, &idx);
+        unsigned short crc = crc16_ccitt(image, size);
+	if (verbose)
+	{
+		diagnostic(DPS_DIAG_INFO, "Image size", NULL, size);
+		diagnostic(DPS_DIAG_INFO, "Image CRC", NULL, crc);
+	}
+
+        int idx = 0;
+        pack16(chunk_size, &payload, &idx);
+	pack8((crc >> 8), &payload, &idx);
+	pack8((crc & 0xff), &payload, &idx);
+        int rc = transact(CMD_UPGRADE_START, payload, idx, &response, NULL);
+        if (rc == 0 && response.len >= 2) {
+		idx = 0;
+                __uint16_t dps_chunk_size = unpack16((__uint8_t *) response.data, &idx);
                 if (chunk_size != dps_chunk_size) {
 			if (verbose)
-				printf("DPS selected chunk size %d\n", dps_chunk_size);
+				diagnostic(DPS_DIAG_INFO, "DPS selected chunk size", NULL, dps_chunk_size);
                         chunk_size = dps_chunk_size;
                 }
-		FILE *file = fopen(fw_file_name, "r");
-		if (file == NULL) {
-			if (verbose)
-				printf("Failed to open firmware file: %s\n", fw_file_name);
-			return -EIO;
+		if (chunk_size == 0 || chunk_size > UPGRADE_CHUNK_SIZE) {
+			diagnostic(DPS_DIAG_ERROR, "Unsupported chunk size", NULL, -EMSGSIZE);
+			return -EMSGSIZE;
 		}
-		fseek(file, 0, SEEK_END); // seek to end of file
-		long fw_size = ftell(file); // get current file pointer
-		fseek(file, 0, SEEK_SET); // seek back to beginning of file
-                __uint8_t input_buf[chunk_size + 1];
-                input_buf[0] = CMD_UPGRADE_DATA;
-		void *buf_ptr = &input_buf;
 		long counter = 0;
-		size_t read;
-                while(read = fread(buf_ptr + 1, sizeof(__uint8_t), chunk_size, file)) {
+                while (counter < size) {
+			long read = size - counter < chunk_size ? size - counter : chunk_size;
+			// the last chunk is answered with UPGRADE_SUCCESS
+			if (counter + read == size)
+				rc = transact_expect(CMD_UPGRADE_DATA, UPGRADE_SUCCESS, image + counter, read, &response, NULL);
+			else
+				rc = transact(CMD_UPGRADE_DATA, image + counter, read, &response, NULL);
 			counter += read;
-                        rc = send_cmd(fd, &input_buf, read + 1);
-                        if (rc < 0)
-                                break;
-                        rc = get_response(fd, &response_buffer, sizeof(response_buffer));
-                        if (rc < 0)
-                                break;
-
-			if (response_buffer[0] == (CMD_UPGRADE_DATA ^ CMD_RESPONSE)) {
-				idx = 1;
-				__uint8_t status = unpack8(response_buffer, &idx);
-				if (status == UPGRADE_CONTINUE) {
-					if (progress != NULL)
-						progress((100 * counter) / fw_size);
-					continue;
-				} else if (status == UPGRADE_ERASE_ERROR) {
-					if (verbose)
-						printf("DPS reported erase failed.\n");
-					rc = -EIO;
-					break;
-				} else if (status == UPGRADE_CRC_ERROR) {
-					if (verbose)
-						printf("DPS reported flash error.\n");
-					rc = -EIO;
-					break;
-				} else if (status == UPGRADE_OVERFLOW_ERROR) {
-					if (verbose)
-						printf("DPS reported firmware overflow error.\n");
-					rc = -EIO;
-					break;
-				} else if (status == UPGRADE_SUCCESS) {
-					if (progress != NULL)
-						progress(100);
-					rc = 0;
-					break;
-				} else {
-					if (verbose)
-						printf("DPS reported unknown error code: %d\n", status);
-				}
+			if (rc == 0) {
+				if (progress != NULL)
+					progress((100 * counter) / size);
+				continue;
+			} else if (rc != -EREMOTEIO) {
+				break;
 			}
 
+			if (response.status == UPGRADE_ERASE_ERROR) {
+				if (verbose)
+					diagnostic(DPS_DIAG_ERROR, "DPS reported erase failed.", NULL, 0);
+				rc = -EIO;
+				break;
+			} else if (response.status == UPGRADE_CRC_ERROR) {
+				if (verbose)
+					diagnostic(DPS_DIAG_ERROR, "DPS reported flash error.", NULL, 0);
+				rc = -EIO;
+				break;
+			} else if (response.status == UPGRADE_OVERFLOW_ERROR) {
+				if (verbose)
+					diagnostic(DPS_DIAG_ERROR, "DPS reported firmware overflow error.", NULL, 0);
+				rc = -EIO;
+				break;
+			} else if (response.status == UPGRADE_SUCCESS) {
+				if (progress != NULL)
+					progress(100);
+				rc = 0;
+				break;
+			} else {
+				if (verbose)
+					diagnostic(DPS_DIAG_INFO, "DPS reported unknown error code", NULL, response.status);
+			}
                 }
-		fclose(file);
 		return rc;
         } else {
-                printf("Failed to start upgrade.\n");
+                diagnostic(DPS_DIAG_ERROR, "Failed to start upgrade.", NULL, 0);
+		return -EIO;
         }
-
 }
 
+#ifndef OPENDPS_EMBEDDED
+int dps_upgrade(char *fw_file_name, cb_upgrade_progress progress)
+{
+	FILE *file = fopen(fw_file_name, "r");
+	if (file == NULL) {
+		if (verbose)
+			diagnostic(DPS_DIAG_ERROR, "Failed to open firmware file", fw_file_name, -errno);
+		return -EIO;
+	}
+	fseek(file, 0, SEEK_END); // seek to end of file
+	long fw_size = ftell(file); // get current file pointer
+	fseek(file, 0, SEEK_SET); // seek back to beginning of file
+	__uint8_t *image = malloc(fw_size > 0 ? fw_size : 1);
+	int rc = -ENOMEM;
+	if (image != NULL) {
+		if (fw_size > 0 && fread(image, sizeof(__uint8_t), fw_size, file) == (size_t) fw_size)
+			rc = dps_upgrade_image(image, fw_size, progress);
+		else
+			rc = -EIO;
+		free(image);
+	}
+	fclose(file);
+	return rc;
+}
+#endif
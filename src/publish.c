@@ -0,0 +1,264 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "opendps/publish.h"
+
+#define SHM_MAGIC 0x53535044			// "DPSS" little endian
+
+static bool owner_alive(pid_t owner)
+{
+	return owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH);
+}
+
+static bool claim(dps_shm_slot_t *slot, pid_t owner)
+{
+	return __atomic_compare_exchange_n(&slot->owner, &owner, getpid(), false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+// single writer per slot, guaranteed by the claim
+static void slot_write(dps_shm_slot_t *slot, const dps_shm_state_t *state)
+{
+	__uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&slot->state, state, sizeof(*state));
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static int slot_read(const dps_shm_slot_t *slot, dps_shm_state_t *state)
+{
+	for (int attempt = 0; attempt < DPS_SHM_READ_ATTEMPTS; attempt++)
+	{
+		__uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(state, &slot->state, sizeof(*state));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -EAGAIN;
+}
+
+// device of a slot, read under its seqlock
+static bool slot_device(const dps_shm_slot_t *slot, const char *device)
+{
+	dps_shm_state_t state;
+	return slot_read(slot, &state) == 0 && strcmp(state.device, device) == 0;
+}
+
+// a publisher that died while claiming leaves the lock behind, take it over
+static int segment_lock(dps_shm_segment_t *segment)
+{
+	struct timespec backoff = { .tv_sec = 0, .tv_nsec = 1000000 };
+	for (int attempt = 0; attempt < DPS_SHM_LOCK_ATTEMPTS; attempt++)
+	{
+		pid_t holder = __atomic_load_n(&segment->lock, __ATOMIC_RELAXED);
+		if ((holder == 0 || !owner_alive(holder)) &&
+		    __atomic_compare_exchange_n(&segment->lock, &holder, getpid(), false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 0;
+		nanosleep(&backoff, NULL);
+	}
+	return -EBUSY;
+}
+
+static void segment_unlock(dps_shm_segment_t *segment)
+{
+	__atomic_store_n(&segment->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void *segment_map(const char *name, bool writable)
+{
+	struct stat st;
+	int fd = shm_open(name != NULL ? name : DPS_SHM_NAME, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd < 0)
+		return MAP_FAILED;
+	if (fstat(fd, &st) < 0 || (st.st_size < (off_t) sizeof(dps_shm_segment_t) &&
+				   (!writable || ftruncate(fd, sizeof(dps_shm_segment_t)) < 0)))
+	{
+		int err = st.st_size < (off_t) sizeof(dps_shm_segment_t) && !writable ? EPROTO : errno;
+		close(fd);
+		errno = err;
+		return MAP_FAILED;
+	}
+	void *segment = mmap(NULL, sizeof(dps_shm_segment_t), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return segment;
+}
+
+int dps_publisher_open(dps_publisher_t *publisher, const char *name, const char *device)
+{
+	dps_shm_segment_t *segment = segment_map(name, true);
+	dps_shm_slot_t *slot = NULL;
+	__uint32_t magic = 0;
+	memset(publisher, 0, sizeof(*publisher));
+	if (segment == MAP_FAILED)
+		return -errno;
+	if (strlen(device) >= DPS_SHM_DEVICE_NAME)
+	{
+		munmap(segment, sizeof(*segment));
+		return -ENAMETOOLONG;
+	}
+	// the first publisher formats the zero filled segment, the size is in
+	// place before readers can see the magic
+	magic = __atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE);
+	if (magic != 0 && magic != SHM_MAGIC)
+	{
+		munmap(segment, sizeof(*segment));
+		return -EPROTO;
+	}
+	__atomic_store_n(&segment->size, sizeof(*segment), __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&segment->magic, &magic, SHM_MAGIC, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE) &&
+	    magic != SHM_MAGIC)
+	{
+		munmap(segment, sizeof(*segment));
+		return -EPROTO;
+	}
+
+	// the device name is written before the lock is released, so the
+	// next publisher of the same device finds this slot
+	int rc = segment_lock(segment);
+	if (rc < 0)
+	{
+		munmap(segment, sizeof(*segment));
+		return rc;
+	}
+	// take over the slot of a previous publisher for the same device
+	for (int i = 0; i < DPS_SHM_SLOTS && slot == NULL; i++)
+	{
+		dps_shm_slot_t *candidate = &segment->slots[i];
+		if (!slot_device(candidate, device))
+			continue;
+		pid_t owner = __atomic_load_n(&candidate->owner, __ATOMIC_ACQUIRE);
+		if (owner_alive(owner) || !claim(candidate, owner))
+		{
+			segment_unlock(segment);
+			munmap(segment, sizeof(*segment));
+			return -EBUSY;
+		}
+		slot = candidate;
+	}
+	// then a free slot, then one left behind by a dead publisher
+	for (int i = 0; i < DPS_SHM_SLOTS && slot == NULL; i++)
+		if (claim(&segment->slots[i], 0))
+			slot = &segment->slots[i];
+	for (int i = 0; i < DPS_SHM_SLOTS && slot == NULL; i++)
+	{
+		pid_t owner = __atomic_load_n(&segment->slots[i].owner, __ATOMIC_ACQUIRE);
+		if (!owner_alive(owner) && claim(&segment->slots[i], owner))
+			slot = &segment->slots[i];
+	}
+	if (slot == NULL)
+	{
+		segment_unlock(segment);
+		munmap(segment, sizeof(*segment));
+		return -ENOSPC;
+	}
+
+	strcpy(publisher->state.device, device);
+	publisher->state.query_rc = -ENODATA;
+	dps_link_health(&publisher->state.health);
+	slot_write(slot, &publisher->state);
+	segment_unlock(segment);
+	publisher->segment = segment;
+	publisher->slot = slot;
+	return 0;
+}
+
+void dps_publish(dps_publisher_t *publisher, int query_rc, const dps_query_t *status)
+{
+	struct timespec now;
+	dps_shm_state_t *state = &publisher->state;
+	state->updates++;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	state->sampled_us = (__int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	clock_gettime(CLOCK_REALTIME, &now);
+	state->published_ms = (__int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	state->query_rc = query_rc;
+	if (query_rc == 0)
+		state->status = *status;
+	dps_link_health(&state->health);
+	slot_write(publisher->slot, state);
+}
+
+// the last state stays readable, the slot may be taken over
+void dps_publisher_close(dps_publisher_t *publisher)
+{
+	if (publisher->segment == NULL)
+		return;
+	__atomic_store_n(&publisher->slot->owner, 0, __ATOMIC_RELEASE);
+	munmap(publisher->segment, sizeof(*publisher->segment));
+	publisher->segment = NULL;
+	publisher->slot = NULL;
+}
+
+int dps_reader_open(dps_reader_t *reader, const char *name)
+{
+	const dps_shm_segment_t *segment = segment_map(name, false);
+	reader->segment = NULL;
+	if (segment == MAP_FAILED)
+		return -errno;
+	if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+	    __atomic_load_n(&segment->size, __ATOMIC_RELAXED) != sizeof(*segment))
+	{
+		munmap((void *) segment, sizeof(*segment));
+		return -EPROTO;
+	}
+	reader->segment = segment;
+	return 0;
+}
+
+int dps_reader_find(const dps_reader_t *reader, const char *device)
+{
+	dps_shm_state_t state;
+	for (int i = 0; i < DPS_SHM_SLOTS; i++)
+		if (dps_reader_snapshot(reader, i, &state) == 0 && strcmp(state.device, device) == 0)
+			return i;
+	return -ENOENT;
+}
+
+/*
+ * Copy a consistent state of a slot. Fails with -ENOENT for a slot that
+ * was never published and with -EAGAIN if every attempt raced a write.
+ */
+int dps_reader_snapshot(const dps_reader_t *reader, int slot, dps_shm_state_t *state)
+{
+	if (slot < 0 || slot >= DPS_SHM_SLOTS)
+		return -EINVAL;
+	int rc = slot_read(&reader->segment->slots[slot], state);
+	if (rc == 0 && state->device[0] == '\0')
+		return -ENOENT;
+	return rc;
+}
+
+void dps_reader_close(dps_reader_t *reader)
+{
+	if (reader->segment != NULL)
+		munmap((void *) reader->segment, sizeof(*reader->segment));
+	reader->segment = NULL;
+}
@@ -0,0 +1,109 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <time.h>
+#include "opendps/sequence.h"
+
+static long elapsed_us(const struct timespec *start, const struct timespec *now)
+{
+	return (now->tv_sec - start->tv_sec) * 1000000L + (now->tv_nsec - start->tv_nsec) / 1000;
+}
+
+int dps_sequence_prepare(dps_seq_step_t *steps, int count)
+{
+	__uint8_t cmd_buffer[DPS_SEQ_CMD_SIZE];
+	for (int i = 0; i < count; i++)
+	{
+		dps_seq_step_t *step = &steps[i];
+		if (step->num_params > DPS_SEQ_MAX_PARAMS || step->offset_us < 0)
+			return -EINVAL;
+		if (i > 0 && step->offset_us < steps[i - 1].offset_us)
+			return -EINVAL;
+		int size = dps_encode_parameters(step->params, step->num_params, cmd_buffer, sizeof(cmd_buffer));
+		if (size < 0)
+			return size;
+		size = dps_encode_frame(cmd_buffer, size, step->frame, sizeof(step->frame));
+		if (size < 0)
+			return size;
+		step->frame_len = size;
+		step->issued_us = -1;
+		step->rc = -EAGAIN;
+	}
+	return 0;
+}
+
+/*
+ * Returns the number of steps that were not acknowledged by the DPS, or a
+ * negative error if the sequence could not be started. A step that is
+ * issued late (because the previous response took longer than the gap
+ * between two steps) is still issued and shows up in issued_us.
+ */
+int dps_sequence_run(dps_seq_step_t *steps, int count)
+{
+	__uint8_t response_buffer[32];
+	struct timespec start;
+	int failed = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (steps[i].frame_len <= 0)
+			return -EINVAL;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start) != 0)
+		return -errno;
+
+	for (int i = 0; i < count; i++)
+	{
+		dps_seq_step_t *step = &steps[i];
+		struct timespec deadline = start;
+		struct timespec now;
+		int rc;
+
+		deadline.tv_sec += step->offset_us / 1000000;
+		deadline.tv_nsec += (step->offset_us % 1000000) * 1000;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		step->issued_us = elapsed_us(&start, &now);
+		rc = dps_send_frame(step->frame, step->frame_len);
+		if (rc >= 0)
+		{
+			rc = dps_get_response(&response_buffer, sizeof(response_buffer));
+			if (rc > 0)
+				rc = dps_response_ok(CMD_SET_PARAMETERS, &response_buffer, CMD_STATUS_SUCC);
+			else if (rc == 0)
+				rc = -EPROTO;
+		}
+		step->rc = rc;
+		if (rc != 0)
+			failed++;
+	}
+	return failed;
+}
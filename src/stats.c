@@ -0,0 +1,252 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <math.h>
+#include "opendps/stats.h"
+
+static void sums_add(dps_stats_sums_t *sums, __uint16_t v, __uint16_t i)
+{
+	sums->count++;
+	sums->v_sum += v;
+	sums->v_sum_sq += (__uint64_t) v * v;
+	sums->i_sum += i;
+	sums->i_sum_sq += (__uint64_t) i * i;
+	sums->p_sum += (__uint64_t) v * i;
+}
+
+static void sums_sub(dps_stats_sums_t *sums, __uint16_t v, __uint16_t i)
+{
+	sums->count--;
+	sums->v_sum -= v;
+	sums->v_sum_sq -= (__uint64_t) v * v;
+	sums->i_sum -= i;
+	sums->i_sum_sq -= (__uint64_t) i * i;
+	sums->p_sum -= (__uint64_t) v * i;
+}
+
+static void sums_result(const dps_stats_sums_t *sums, dps_stats_result_t *result)
+{
+	result->count = sums->count;
+	if (sums->count > 0)
+	{
+		result->v_mean = (double) sums->v_sum / sums->count;
+		result->v_rms = sqrt((double) sums->v_sum_sq / sums->count);
+		result->i_mean = (double) sums->i_sum / sums->count;
+		result->i_rms = sqrt((double) sums->i_sum_sq / sums->count);
+		result->p_mean = (double) sums->p_sum / sums->count / 1000;
+	}
+	result->charge_mah = sums->charge / 3.6e9;	// mA * us -> mAh
+	result->energy_wh = sums->energy / 3.6e15;	// uW * us -> Wh
+}
+
+static void queue_push(dps_minmax_queue_t *queue, int window, const __uint16_t *values, long seq, bool max)
+{
+	__uint16_t value = values[seq % window];
+	// drop samples that left the window
+	while (queue->len > 0 && queue->seq[queue->head] <= seq - window)
+	{
+		queue->head = (queue->head + 1) % window;
+		queue->len--;
+	}
+	// drop samples that can no longer become the min (max)
+	while (queue->len > 0)
+	{
+		__uint16_t last = values[queue->seq[(queue->head + queue->len - 1) % window] % window];
+		if (max ? last > value : last < value)
+			break;
+		queue->len--;
+	}
+	queue->seq[(queue->head + queue->len) % window] = seq;
+	queue->len++;
+}
+
+static __uint16_t queue_front(const dps_minmax_queue_t *queue, int window, const __uint16_t *values)
+{
+	return values[queue->seq[queue->head] % window];
+}
+
+void dps_stats_init(dps_stats_t *stats, int window)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (window < 2)
+		window = 2;
+	if (window > DPS_STATS_WINDOW)
+		window = DPS_STATS_WINDOW;
+	stats->window = window;
+	stats->v_min = 0xffff;
+	stats->i_min = 0xffff;
+}
+
+void dps_stats_add(dps_stats_t *stats, __int64_t timestamp_us, const dps_query_t *sample)
+{
+	int window = stats->window;
+	int slot = stats->seq % window;
+	double charge = 0;
+	double energy = 0;
+
+	if (stats->seq == 0)
+	{
+		stats->first_us = timestamp_us;
+	}
+	else if (timestamp_us > stats->last_us)
+	{
+		// trapezoid between the previous sample and this one
+		int prev = (stats->seq - 1) % window;
+		double dt = timestamp_us - stats->last_us;
+		charge = (stats->i_out[prev] + sample->i_out) * dt / 2;
+		energy = ((double) stats->v_out[prev] * stats->i_out[prev] + (double) sample->v_out * sample->i_out) * dt / 2;
+	}
+
+	if (stats->seq >= window)
+	{
+		// the oldest sample leaves, the integral now starts at the next one
+		int next = (stats->seq - window + 1) % window;
+		sums_sub(&stats->recent, stats->v_out[slot], stats->i_out[slot]);
+		stats->recent.charge -= stats->charge[next];
+		stats->recent.energy -= stats->energy[next];
+	}
+
+	stats->timestamp_us[slot] = timestamp_us;
+	stats->v_out[slot] = sample->v_out;
+	stats->i_out[slot] = sample->i_out;
+	stats->charge[slot] = charge;
+	stats->energy[slot] = energy;
+
+	sums_add(&stats->recent, sample->v_out, sample->i_out);
+	stats->recent.charge += charge;
+	stats->recent.energy += energy;
+	sums_add(&stats->total, sample->v_out, sample->i_out);
+	stats->total.charge += charge;
+	stats->total.energy += energy;
+
+	queue_push(&stats->v_min_queue, window, stats->v_out, stats->seq, false);
+	queue_push(&stats->v_max_queue, window, stats->v_out, stats->seq, true);
+	queue_push(&stats->i_min_queue, window, stats->i_out, stats->seq, false);
+	queue_push(&stats->i_max_queue, window, stats->i_out, stats->seq, true);
+
+	if (sample->v_out < stats->v_min)
+		stats->v_min = sample->v_out;
+	if (sample->v_out > stats->v_max)
+		stats->v_max = sample->v_out;
+	if (sample->i_out < stats->i_min)
+		stats->i_min = sample->i_out;
+	if (sample->i_out > stats->i_max)
+		stats->i_max = sample->i_out;
+
+	if (timestamp_us > stats->last_us || stats->seq == 0)
+		stats->last_us = timestamp_us;
+	stats->seq++;
+}
+
+void dps_stats_total(const dps_stats_t *stats, dps_stats_result_t *result)
+{
+	memset(result, 0, sizeof(*result));
+	if (stats->seq == 0)
+		return;
+	sums_result(&stats->total, result);
+	result->duration_s = (double)(stats->last_us - stats->first_us) / 1000000;
+	result->v_min = stats->v_min;
+	result->v_max = stats->v_max;
+	result->i_min = stats->i_min;
+	result->i_max = stats->i_max;
+}
+
+void dps_stats_window(const dps_stats_t *stats, dps_stats_result_t *result)
+{
+	int window = stats->window;
+	memset(result, 0, sizeof(*result));
+	if (stats->seq == 0)
+		return;
+	long oldest = stats->seq > window ? stats->seq - window : 0;
+	sums_result(&stats->recent, result);
+	result->duration_s = (double)(stats->timestamp_us[(stats->seq - 1) % window] - stats->timestamp_us[oldest % window]) / 1000000;
+	result->v_min = queue_front(&stats->v_min_queue, window, stats->v_out);
+	result->v_max = queue_front(&stats->v_max_queue, window, stats->v_out);
+	result->i_min = queue_front(&stats->i_min_queue, window, stats->i_out);
+	result->i_max = queue_front(&stats->i_max_queue, window, stats->i_out);
+}
+
+/*
+ * The batch loops below are kept branch free with independent accumulators
+ * so the compiler turns them into SIMD code for the target (SSE/AVX, NEON)
+ * instead of tying the library to one instruction set.
+ */
+static void reduce_column(const __uint16_t *x, int count, __uint16_t *min, __uint16_t *max, __uint64_t *sum, __uint64_t *sum_sq)
+{
+	__uint16_t lo = 0xffff;
+	__uint16_t hi = 0;
+	__uint64_t s = 0;
+	__uint64_t sq = 0;
+	for (int i = 0; i < count; i++)
+	{
+		__uint32_t v = x[i];
+		lo = x[i] < lo ? x[i] : lo;
+		hi = x[i] > hi ? x[i] : hi;
+		s += v;
+		sq += v * v;
+	}
+	*min = lo;
+	*max = hi;
+	*sum = s;
+	*sum_sq = sq;
+}
+
+static __uint64_t reduce_power(const __uint16_t *v_out, const __uint16_t *i_out, int count)
+{
+	__uint64_t sum = 0;
+	for (int i = 0; i < count; i++)
+		sum += (__uint32_t) v_out[i] * i_out[i];
+	return sum;
+}
+
+int dps_stats_reduce(const __uint16_t *v_out, const __uint16_t *i_out, const __int64_t *timestamp_us, int count, dps_stats_result_t *result)
+{
+	dps_stats_sums_t sums;
+	__int64_t charge = 0;
+	double energy = 0;
+
+	memset(result, 0, sizeof(*result));
+	if (count <= 0)
+		return count < 0 ? -EINVAL : 0;
+
+	memset(&sums, 0, sizeof(sums));
+	sums.count = count;
+	reduce_column(v_out, count, &result->v_min, &result->v_max, &sums.v_sum, &sums.v_sum_sq);
+	reduce_column(i_out, count, &result->i_min, &result->i_max, &sums.i_sum, &sums.i_sum_sq);
+	sums.p_sum = reduce_power(v_out, i_out, count);
+
+	for (int i = 1; i < count; i++)
+	{
+		__int64_t dt = timestamp_us[i] - timestamp_us[i - 1];
+		dt = dt > 0 ? dt : 0;
+		charge += (__int64_t)(i_out[i] + i_out[i - 1]) * dt;
+		energy += ((double) v_out[i] * i_out[i] + (double) v_out[i - 1] * i_out[i - 1]) * dt;
+	}
+	sums.charge = (double) charge / 2;
+	sums.energy = energy / 2;
+
+	sums_result(&sums, result);
+	result->duration_s = (double)(timestamp_us[count - 1] - timestamp_us[0]) / 1000000;
+	return 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "opendps/store.h"
+
+#define STORE_MAGIC 0x53535044 // "DPSS"
+#define TEMP_INVALID -32768
+#define MAX_SAMPLE_SIZE (DPS_STORE_COLUMNS * 10)
+
+typedef struct segment_t {
+	__uint32_t magic;
+	__uint32_t count;
+	__uint32_t used;			// bytes of encoded samples after the header
+	__uint32_t reserved;
+	__int64_t first_ts;
+	__int64_t last_ts;
+} segment_t;
+
+enum {
+	COL_TIMESTAMP,
+	COL_V_IN,
+	COL_V_OUT,
+	COL_I_OUT,
+	COL_TEMP1,
+	COL_TEMP2,
+	COL_FLAGS
+};
+
+static __int64_t encode_temp(double temp)
+{
+	if (temp == -DBL_MAX)
+		return TEMP_INVALID;
+	return (__int64_t)(temp * 10 + (temp < 0 ? -0.5 : 0.5));
+}
+
+static double decode_temp(__int64_t temp)
+{
+	return temp == TEMP_INVALID ? -DBL_MAX : (double) temp / 10;
+}
+
+static void to_columns(__int64_t timestamp_ms, const dps_query_t *sample, __int64_t *col)
+{
+	col[COL_TIMESTAMP] = timestamp_ms;
+	col[COL_V_IN] = sample->v_in;
+	col[COL_V_OUT] = sample->v_out;
+	col[COL_I_OUT] = sample->i_out;
+	col[COL_TEMP1] = encode_temp(sample->temp1);
+	col[COL_TEMP2] = encode_temp(sample->temp2);
+	col[COL_FLAGS] = (sample->output_enabled ? 1 : 0) | (sample->temp_shutdown ? 2 : 0);
+}
+
+static void from_columns(const __int64_t *col, dps_query_t *sample)
+{
+	sample->v_in = col[COL_V_IN];
+	sample->v_out = col[COL_V_OUT];
+	sample->i_out = col[COL_I_OUT];
+	sample->temp1 = decode_temp(col[COL_TEMP1]);
+	sample->temp2 = decode_temp(col[COL_TEMP2]);
+	sample->output_enabled = (col[COL_FLAGS] & 1) != 0;
+	sample->temp_shutdown = (col[COL_FLAGS] & 2) != 0;
+}
+
+static int encode_sample(__int64_t *last, const __int64_t *col, __uint8_t *buf)
+{
+	int idx = 0;
+	for (int i = 0; i < DPS_STORE_COLUMNS; i++)
+	{
+		__int64_t delta = col[i] - last[i];
+		__uint64_t zigzag = ((__uint64_t) delta << 1) ^ (__uint64_t)(delta >> 63);
+		while (zigzag >= 0x80)
+		{
+			buf[idx++] = (zigzag & 0x7f) | 0x80;
+			zigzag >>= 7;
+		}
+		buf[idx++] = zigzag;
+		last[i] = col[i];
+	}
+	return idx;
+}
+
+static int decode_sample(__int64_t *last, const __uint8_t *buf, int len)
+{
+	int idx = 0;
+	for (int i = 0; i < DPS_STORE_COLUMNS; i++)
+	{
+		__uint64_t zigzag = 0;
+		int shift = 0;
+		do {
+			if (idx >= len || shift > 63)
+				return -EPROTO;
+			zigzag |= (__uint64_t)(buf[idx] & 0x7f) << shift;
+			shift += 7;
+		} while (buf[idx++] & 0x80);
+		last[i] += (__int64_t)(zigzag >> 1) ^ -(__int64_t)(zigzag & 1);
+	}
+	return idx;
+}
+
+static int map_tail(dps_store_t *store)
+{
+	void *tail = mmap(NULL, DPS_STORE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd,
+			(off_t)(store->segments - 1) * DPS_STORE_SEGMENT_SIZE);
+	if (tail == MAP_FAILED)
+		return -errno;
+	store->tail = tail;
+	return 0;
+}
+
+static int add_segment(dps_store_t *store)
+{
+	if (store->tail != NULL)
+	{
+		munmap(store->tail, DPS_STORE_SEGMENT_SIZE);
+		store->tail = NULL;
+	}
+	if (ftruncate(store->fd, (off_t)(store->segments + 1) * DPS_STORE_SEGMENT_SIZE) != 0)
+		return -errno;
+	store->segments++;
+	int rc = map_tail(store);
+	if (rc < 0)
+		return rc;
+	segment_t *seg = (segment_t *) store->tail;
+	memset(seg, 0, sizeof(*seg));
+	seg->magic = STORE_MAGIC;
+	memset(store->last, 0, sizeof(store->last));
+	return 0;
+}
+
+int dps_store_open(dps_store_t *store, const char *file_name, bool writable)
+{
+	struct stat st;
+	memset(store, 0, sizeof(*store));
+	store->fd = open(file_name, writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+	if (store->fd < 0)
+		return -errno;
+	if (fstat(store->fd, &st) != 0 || st.st_size % DPS_STORE_SEGMENT_SIZE != 0)
+	{
+		dps_store_close(store);
+		return -EINVAL;
+	}
+	store->segments = st.st_size / DPS_STORE_SEGMENT_SIZE;
+	if (!writable)
+		return 0;
+
+	int rc = store->segments == 0 ? add_segment(store) : map_tail(store);
+	if (rc < 0)
+	{
+		dps_store_close(store);
+		return rc;
+	}
+
+	// replay the tail segment to restore the delta state
+	segment_t *seg = (segment_t *) store->tail;
+	__uint8_t *data = store->tail + sizeof(segment_t);
+	int idx = 0;
+	if (seg->magic != STORE_MAGIC)
+	{
+		dps_store_close(store);
+		return -EINVAL;
+	}
+	for (__uint32_t i = 0; i < seg->count; i++)
+	{
+		rc = decode_sample(store->last, data + idx, seg->used - idx);
+		if (rc < 0)
+		{
+			dps_store_close(store);
+			return rc;
+		}
+		idx += rc;
+	}
+	return 0;
+}
+
+int dps_store_append(dps_store_t *store, __int64_t timestamp_ms, const dps_query_t *sample)
+{
+	__int64_t col[DPS_STORE_COLUMNS];
+	__int64_t next[DPS_STORE_COLUMNS];
+	__uint8_t buf[MAX_SAMPLE_SIZE];
+
+	if (store->tail == NULL)
+		return -EBADF;
+	if (timestamp_ms < store->last[COL_TIMESTAMP])
+		return -EINVAL;
+
+	to_columns(timestamp_ms, sample, col);
+	memcpy(next, store->last, sizeof(next));
+	int len = encode_sample(next, col, buf);
+
+	segment_t *seg = (segment_t *) store->tail;
+	if (sizeof(segment_t) + seg->used + len > DPS_STORE_SEGMENT_SIZE)
+	{
+		int rc = add_segment(store);
+		if (rc < 0)
+			return rc;
+		seg = (segment_t *) store->tail;
+		memset(next, 0, sizeof(next));
+		len = encode_sample(next, col, buf);
+	}
+
+	// write the sample before publishing it in the header
+	memcpy(store->tail + sizeof(segment_t) + seg->used, buf, len);
+	if (seg->count == 0)
+		seg->first_ts = timestamp_ms;
+	seg->last_ts = timestamp_ms;
+	seg->used += len;
+	seg->count++;
+	memcpy(store->last, next, sizeof(next));
+	return 0;
+}
+
+/*
+ * Calls cb for every sample with from_ms <= timestamp <= to_ms, in order.
+ * Reading stops early when cb returns non-zero. Returns the number of
+ * samples delivered.
+ */
+int dps_store_read(dps_store_t *store, __int64_t from_ms, __int64_t to_ms, cb_store_sample cb, void *ctx)
+{
+	struct stat st;
+	int delivered = 0;
+
+	if (fstat(store->fd, &st) != 0)
+		return -errno;
+	int segments = st.st_size / DPS_STORE_SEGMENT_SIZE;
+	if (segments == 0)
+		return 0;
+	__uint8_t *map = mmap(NULL, (size_t) segments * DPS_STORE_SEGMENT_SIZE, PROT_READ, MAP_SHARED, store->fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	// find the first segment that ends at or after from_ms
+	int lo = 0;
+	int hi = segments;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		segment_t *seg = (segment_t *)(map + (size_t) mid * DPS_STORE_SEGMENT_SIZE);
+		if (seg->count == 0 || seg->last_ts < from_ms)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (int s = lo; s < segments; s++)
+	{
+		segment_t *seg = (segment_t *)(map + (size_t) s * DPS_STORE_SEGMENT_SIZE);
+		__uint8_t *data = (__uint8_t *) seg + sizeof(segment_t);
+		__uint32_t count = seg->count;
+		__uint32_t used = seg->used;
+		__int64_t col[DPS_STORE_COLUMNS] = { 0 };
+		__uint32_t idx = 0;
+
+		if (seg->magic != STORE_MAGIC || count == 0 || seg->first_ts > to_ms)
+			break;
+		for (__uint32_t i = 0; i < count; i++)
+		{
+			dps_query_t sample;
+			int rc = decode_sample(col, data + idx, used - idx);
+			if (rc < 0)
+			{
+				munmap(map, (size_t) segments * DPS_STORE_SEGMENT_SIZE);
+				return rc;
+			}
+			idx += rc;
+			if (col[COL_TIMESTAMP] < from_ms)
+				continue;
+			if (col[COL_TIMESTAMP] > to_ms)
+				break;
+			from_columns(col, &sample);
+			delivered++;
+			if (cb(ctx, col[COL_TIMESTAMP], &sample) != 0)
+			{
+				munmap(map, (size_t) segments * DPS_STORE_SEGMENT_SIZE);
+				return delivered;
+			}
+		}
+	}
+	munmap(map, (size_t) segments * DPS_STORE_SEGMENT_SIZE);
+	return delivered;
+}
+
+void dps_store_close(dps_store_t *store)
+{
+	if (store->tail != NULL)
+		munmap(store->tail, DPS_STORE_SEGMENT_SIZE);
+	if (store->fd >= 0)
+		close(store->fd);
+	store->tail = NULL;
+	store->fd = -1;
+}
@@ -0,0 +1,178 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <time.h>
+#include "opendps/sweep.h"
+
+static long elapsed_us(const struct timespec *start, const struct timespec *now)
+{
+	return (now->tv_sec - start->tv_sec) * 1000000L + (now->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void sleep_until(const struct timespec *from, long delay_us)
+{
+	struct timespec deadline = *from;
+	deadline.tv_sec += delay_us / 1000000;
+	deadline.tv_nsec += (delay_us % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+}
+
+static int sweep_setpoint(const dps_sweep_t *sweep, int point)
+{
+	return sweep->stop >= sweep->start ? sweep->start + point * sweep->step : sweep->start - point * sweep->step;
+}
+
+int dps_sweep_points(const dps_sweep_t *sweep)
+{
+	if (sweep->param == NULL || sweep->step <= 0 || sweep->samples <= 0 || sweep->settle_us < 0)
+		return -EINVAL;
+	return abs(sweep->stop - sweep->start) / sweep->step + 1;
+}
+
+static int query(const __uint8_t *frame, int len, dps_query_t *result)
+{
+	__uint8_t response_buffer[128];
+	int rc = dps_send_frame(frame, len);
+	if (rc < 0)
+		return rc;
+	rc = dps_get_response(&response_buffer, sizeof(response_buffer));
+	if (rc > 0 && dps_decode_query(&response_buffer, rc, result) == 0)
+		return 0;
+	// fall back to a query with retries
+	return dps_query(result);
+}
+
+/*
+ * Send the query and the next setpoint back-to-back, then collect both
+ * responses. Whichever response got lost is redone with retries.
+ */
+static int query_and_set(const __uint8_t *frame, int len, dps_query_t *result, dps_param_t *next, struct timespec *set_time)
+{
+	__uint8_t cmd_buffer[64];
+	__uint8_t set_frame[2 * sizeof(cmd_buffer) + 2];
+	__uint8_t response_buffer[128];
+	bool got_query = false;
+	bool got_set = false;
+
+	int size = dps_encode_parameters(next, 1, cmd_buffer, sizeof(cmd_buffer));
+	if (size < 0)
+		return size;
+	size = dps_encode_frame(cmd_buffer, size, set_frame, sizeof(set_frame));
+	if (size < 0)
+		return size;
+
+	int rc = dps_send_frame(frame, len);
+	if (rc < 0)
+		return rc;
+	clock_gettime(CLOCK_MONOTONIC, set_time);
+	rc = dps_send_frame(set_frame, size);
+	if (rc < 0)
+		return rc;
+
+	for (int i = 0; i < 2; i++)
+	{
+		rc = dps_get_response(&response_buffer, sizeof(response_buffer));
+		if (rc <= 0)
+			break;
+		if (dps_decode_query(&response_buffer, rc, result) == 0)
+			got_query = true;
+		else if (dps_response_ok(CMD_SET_PARAMETERS, &response_buffer, CMD_STATUS_SUCC) == 0)
+			got_set = true;
+	}
+
+	if (!got_set)
+	{
+		rc = dps_set(next, 1);
+		if (rc < 0)
+			return rc;
+		clock_gettime(CLOCK_MONOTONIC, set_time);
+	}
+	if (!got_query)
+		return dps_query(result);
+	return 0;
+}
+
+int dps_sweep(const dps_sweep_t *sweep, dps_sweep_result_t *result)
+{
+	__uint8_t cmd_buffer[] = { CMD_QUERY };
+	__uint8_t query_frame[OUTPUT_BUFFER_SIZE];
+	struct timespec start, set_time, now;
+	dps_param_t param = { sweep->param, sweep->start };
+	dps_query_t status;
+
+	int points = dps_sweep_points(sweep);
+	if (points < 0)
+		return points;
+	if (result->capacity < points)
+		return -ENOBUFS;
+	result->count = 0;
+
+	int frame_len = dps_encode_frame(cmd_buffer, sizeof(cmd_buffer), query_frame, sizeof(query_frame));
+	if (frame_len < 0)
+		return frame_len;
+
+	int rc = dps_set(&param, 1);
+	if (rc < 0)
+		return rc;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	set_time = start;
+
+	for (int point = 0; point < points; point++)
+	{
+		double v_out = 0;
+		double i_out = 0;
+
+		sleep_until(&set_time, sweep->settle_us);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		result->timestamp_us[point] = elapsed_us(&start, &now);
+
+		for (int sample = 0; sample < sweep->samples; sample++)
+		{
+			if (sample == sweep->samples - 1 && point + 1 < points)
+			{
+				param.value = sweep_setpoint(sweep, point + 1);
+				rc = query_and_set(query_frame, frame_len, &status, &param, &set_time);
+			}
+			else
+			{
+				rc = query(query_frame, frame_len, &status);
+			}
+			if (rc < 0)
+				return rc;
+			v_out += status.v_out;
+			i_out += status.i_out;
+		}
+
+		result->setpoint[point] = sweep_setpoint(sweep, point);
+		result->v_out[point] = v_out / sweep->samples;
+		result->i_out[point] = i_out / sweep->samples;
+		result->count = point + 1;
+	}
+	return 0;
+}
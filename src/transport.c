@@ -0,0 +1,246 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "opendps/transport.h"
+#include "diag.h"
+
+#define LINK_FD(link) ((int)(intptr_t)(link))
+#define RECV_TIMEOUT_US 100000
+
+static int fd_send(void *link, const __uint8_t *frame, int len)
+{
+	int rc = write(LINK_FD(link), frame, len);
+	if (rc < 0)
+		return -errno;
+	tcdrain(LINK_FD(link)); // fails harmlessly on sockets
+	return rc;
+}
+
+static int fd_recv(void *link, __uint8_t *buf, int size)
+{
+	int rc = read(LINK_FD(link), buf, size);
+	if (rc < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+	if (rc == 0)
+	{
+		// a read timeout, unless the other end hung up
+		struct pollfd pfd = { .fd = LINK_FD(link), .events = POLLIN };
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+			return -ENXIO;
+	}
+	return rc;
+}
+
+/*
+ * Message boundaries are kept, so an empty message is not a read timeout.
+ * A dpsctl daemon answers with one when the DPS did not respond.
+ */
+static int seqpacket_recv(void *link, __uint8_t *buf, int size)
+{
+	int rc = recv(LINK_FD(link), buf, size, 0);
+	if (rc < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+	if (rc == 0)
+	{
+		struct pollfd pfd = { .fd = LINK_FD(link), .events = POLLIN };
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+			return -ENXIO;
+		return -ETIMEDOUT;
+	}
+	return rc;
+}
+
+static void fd_close(void *link)
+{
+	close(LINK_FD(link));
+}
+
+const dps_transport_t dps_fd_transport = {
+	.name = "fd",
+	.datagram = false,
+	.send = fd_send,
+	.recv = fd_recv,
+	.close = fd_close,
+};
+
+const dps_transport_t dps_seqpacket_transport = {
+	.name = "seqpacket",
+	.datagram = true,
+	.send = fd_send,
+	.recv = seqpacket_recv,
+	.close = fd_close,
+};
+
+static int udp_send(void *link, const __uint8_t *frame, int len)
+{
+	int rc = send(LINK_FD(link), frame, len, 0);
+	return rc < 0 ? -errno : rc;
+}
+
+static int udp_recv(void *link, __uint8_t *buf, int size)
+{
+	int rc = recv(LINK_FD(link), buf, size, 0);
+	if (rc < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) ? 0 : -errno;
+	return rc;
+}
+
+const dps_transport_t dps_udp_transport = {
+	.name = "udp",
+	.datagram = true,
+	.send = udp_send,
+	.recv = udp_recv,
+	.close = fd_close,
+};
+
+#ifdef OPENDPS_EMBEDDED
+// getaddrinfo() allocates, only numeric IPv4 addresses are accepted
+int dps_init_udp(const char *host, int port, bool pverbose)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((__uint16_t) port) };
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = RECV_TIMEOUT_US };
+	if (port < 1 || port > 65535)
+		return -EINVAL;
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+	{
+		diagnostic(DPS_DIAG_ERROR, "Error resolving", host, -EHOSTUNREACH);
+		return -EHOSTUNREACH;
+	}
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		int rc = -errno;
+		diagnostic(DPS_DIAG_ERROR, "Error connecting to", host, rc);
+		if (fd >= 0)
+			close(fd);
+		return rc;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return dps_init_transport(&dps_udp_transport, (void *)(intptr_t) fd, pverbose);
+}
+#else
+int dps_init_udp(const char *host, int port, bool pverbose)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
+	struct addrinfo *result;
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = RECV_TIMEOUT_US };
+	char service[8];
+	int fd = -1;
+
+	if (port < 1 || port > 65535)
+		return -EINVAL;
+	snprintf(service, sizeof(service), "%u", (unsigned) (__uint16_t) port);
+	int rc = getaddrinfo(host, service, &hints, &result);
+	if (rc != 0)
+	{
+		diagnostic(DPS_DIAG_ERROR, "Error resolving", host, -EHOSTUNREACH);
+		return -EHOSTUNREACH;
+	}
+	for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+	if (fd < 0)
+	{
+		rc = -errno;
+		diagnostic(DPS_DIAG_ERROR, "Error connecting to", host, rc);
+		return rc;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return dps_init_transport(&dps_udp_transport, (void *)(intptr_t) fd, pverbose);
+}
+#endif
+
+static int loopback_send(void *link, const __uint8_t *frame, int len)
+{
+	dps_loopback_t *loopback = link;
+	__uint8_t cmd[DPS_LOOPBACK_BUFFER_SIZE];
+	__uint8_t response[DPS_LOOPBACK_BUFFER_SIZE];
+
+	if (loopback->responder == NULL)
+	{
+		if (loopback->len + len > (int) sizeof(loopback->buf))
+			return -ENOBUFS;
+		memcpy(loopback->buf + loopback->len, frame, len);
+		loopback->len += len;
+		return len;
+	}
+
+	// a garbled command gets no response, like from a real DPS
+	if (len < 2 || frame[0] != _SOF || frame[len - 1] != _EOF)
+		return len;
+	int rc = dps_decode_frame(frame + 1, len - 2, cmd, sizeof(cmd));
+	if (rc <= 0)
+		return len;
+	rc = loopback->responder(loopback->ctx, cmd, rc, response, sizeof(response));
+	if (rc > 0)
+	{
+		rc = dps_encode_frame(response, rc, loopback->buf + loopback->len, sizeof(loopback->buf) - loopback->len);
+		if (rc > 0)
+			loopback->len += rc;
+	}
+	return len;
+}
+
+static int loopback_recv(void *link, __uint8_t *buf, int size)
+{
+	dps_loopback_t *loopback = link;
+	int len = loopback->len < size ? loopback->len : size;
+	memcpy(buf, loopback->buf, len);
+	memmove(loopback->buf, loopback->buf + len, loopback->len - len);
+	loopback->len -= len;
+	return len;
+}
+
+static void loopback_close(void *link)
+{
+	dps_loopback_t *loopback = link;
+	loopback->len = 0;
+}
+
+const dps_transport_t dps_loopback_transport = {
+	.name = "loopback",
+	.datagram = false,
+	.send = loopback_send,
+	.recv = loopback_recv,
+	.close = loopback_close,
+};
+
+int dps_init_loopback(dps_loopback_t *loopback, bool pverbose)
+{
+	loopback->len = 0;
+	return dps_init_transport(&dps_loopback_transport, loopback, pverbose);
+}
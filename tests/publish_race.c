@@ -0,0 +1,160 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Lasse K. Mikkelsen (github.com/lkmikkel)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Two publishers of one device must not both claim a slot. The test plays
+ * a publisher that was preempted between claiming its slot and writing the
+ * device name, and checks that a second publisher of the device waits for
+ * it and then backs off. A claim left behind by a publisher that died must
+ * not block later ones.
+ */
+
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "opendps/publish.h"
+
+#define DEVICE "/dev/ttyDPS"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+static dps_shm_segment_t *map_segment(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	void *segment = mmap(NULL, sizeof(dps_shm_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return segment == MAP_FAILED ? NULL : segment;
+}
+
+static int slots_of(const dps_shm_segment_t *segment, const char *device)
+{
+	int count = 0;
+	for (int i = 0; i < DPS_SHM_SLOTS; i++)
+		if (segment->slots[i].owner != 0 && strcmp(segment->slots[i].state.device, device) == 0)
+			count++;
+	return count;
+}
+
+// open DEVICE in a child, its exit status is the negated result
+static pid_t open_in_child(const char *name)
+{
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		dps_publisher_t publisher;
+		int rc = dps_publisher_open(&publisher, name, DEVICE);
+		// keep the slot owned while the parent looks at the segment
+		if (rc == 0)
+			usleep(200000);
+		_exit(-rc);
+	}
+	return pid;
+}
+
+static int child_result(pid_t pid)
+{
+	int status;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -ECHILD;
+	return -WEXITSTATUS(status);
+}
+
+static void preempted_claim(const char *name, dps_shm_segment_t *segment)
+{
+	struct timespec pause = { .tv_sec = 0, .tv_nsec = 50000000 };
+	dps_shm_slot_t *slot = NULL;
+	pid_t self = getpid();
+	pid_t expected = 0;
+
+	// claim a free slot under the lock, but do not write the device yet
+	check(__atomic_compare_exchange_n(&segment->lock, &expected, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED),
+	      "take the claim lock");
+	for (int i = 0; i < DPS_SHM_SLOTS && slot == NULL; i++)
+		if (segment->slots[i].owner == 0)
+			slot = &segment->slots[i];
+	slot->owner = self;
+
+	pid_t child = open_in_child(name);
+	nanosleep(&pause, NULL);
+	check(waitpid(child, NULL, WNOHANG) == 0, "second publisher waits for the claim in progress");
+	check(slots_of(segment, DEVICE) == 0, "second publisher has not claimed a slot meanwhile");
+
+	// finish the claim like dps_publisher_open() does
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	strcpy(slot->state.device, DEVICE);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&segment->lock, 0, __ATOMIC_RELEASE);
+
+	check(child_result(child) == -EBUSY, "second publisher backs off once the claim is written");
+	check(slots_of(segment, DEVICE) == 1, "the device has a single slot");
+	__atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+}
+
+static void dead_claimant(const char *name, dps_shm_segment_t *segment)
+{
+	// a publisher that dies holding the lock
+	pid_t dead = fork();
+	if (dead == 0)
+	{
+		segment->lock = getpid();
+		_exit(0);
+	}
+	waitpid(dead, NULL, 0);
+	check(segment->lock == dead, "lock left behind by a dead publisher");
+
+	pid_t child = open_in_child(name);
+	check(child_result(child) == 0, "next publisher takes the abandoned lock over");
+	check(segment->lock == 0, "lock released after the claim");
+}
+
+int main()
+{
+	char name[32];
+	dps_publisher_t other;
+
+	snprintf(name, sizeof(name), "/opendps-test-%d", (int) getpid());
+	shm_unlink(name);
+	int rc = dps_publisher_open(&other, name, "/dev/ttyOther");
+	dps_shm_segment_t *segment = rc == 0 ? map_segment(name) : NULL;
+	check(segment != NULL, "format the segment");
+	if (segment != NULL)
+	{
+		preempted_claim(name, segment);
+		dead_claimant(name, segment);
+		munmap(segment, sizeof(*segment));
+		dps_publisher_close(&other);
+	}
+	shm_unlink(name);
+	return failures == 0 ? 0 : 1;
+}